@@ -0,0 +1,180 @@
+/**
+ * libhangish
+ * Copyright (C) 2015 Tiago Salem Herrmann
+ * Copyright (C) 2015 Daniele Rogora
+ *
+ * This file is part of libhangish.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QStringList>
+
+#include <algorithm>
+#include <functional>
+
+#include "completionindex.h"
+#include "idtable.h"
+#include "searchindex.h"
+
+#define TARGET_USER 1
+#define TARGET_CONVERSATION 2
+
+static quint64 completionTarget(int kind, IdHandle id)
+{
+    return ((quint64)kind << 32) | id;
+}
+
+static QString fold(const QString &text)
+{
+    return text.normalized(QString::NormalizationForm_KC).toCaseFolded().simplified();
+}
+
+static void addNameKeys(QList<QPair<QString, int> > &keys, const QString &name)
+{
+    QString folded = fold(name);
+    if (folded.isEmpty()) {
+        return;
+    }
+    keys.append(qMakePair(folded, 2));
+    // the first word is already a prefix of the whole name
+    QStringList words = SearchIndex::tokenize(folded);
+    for (int i = 1; i < words.size(); i++) {
+        keys.append(qMakePair(words.at(i), 1));
+    }
+}
+
+void CompletionIndex::setUser(IdHandle id, const ClientEntity &entity)
+{
+    const ClientEntityProperties &properties = entity.properties();
+    QString name = QString::fromStdString(properties.displayname());
+    QList<QPair<QString, int> > keys;
+    addNameKeys(keys, name);
+    addNameKeys(keys, QString::fromStdString(properties.firstname()));
+    for (int i = 0; i < properties.email_size(); i++) {
+        QString email = fold(QString::fromStdString(properties.email(i)));
+        if (!email.isEmpty()) {
+            keys.append(qMakePair(email, 2));
+        }
+    }
+    if (name.isEmpty() && properties.email_size()) {
+        name = QString::fromStdString(properties.email(0));
+    }
+    setKeys(completionTarget(TARGET_USER, id), name, keys);
+}
+
+void CompletionIndex::setConversation(IdHandle id, const ClientConversation &conversation)
+{
+    quint64 target = completionTarget(TARGET_CONVERSATION, id);
+    mWeights[target] = (quint64)conversation.selfconversationstate().sorttimestamp();
+    QString name = QString::fromStdString(conversation.name());
+    if (mNames.contains(target) && mNames.value(target) == name) {
+        return;
+    }
+    QList<QPair<QString, int> > keys;
+    addNameKeys(keys, name);
+    setKeys(target, name, keys);
+}
+
+void CompletionIndex::setKeys(quint64 target, const QString &name, const QList<QPair<QString, int> > &keys)
+{
+    typedef QPair<QString, int> Key;
+    Q_FOREACH (const Key &key, mTargetKeys.take(target)) {
+        QMap<QString, QVector<Posting> >::iterator it = mKeys.find(key.first);
+        if (it == mKeys.end()) {
+            continue;
+        }
+        for (int i = it->size() - 1; i >= 0; i--) {
+            if (it->at(i).target == target) {
+                it->remove(i);
+            }
+        }
+        if (it->isEmpty()) {
+            mKeys.erase(it);
+        }
+    }
+
+    // the same key can come from several fields, keep its best quality
+    QHash<QString, int> unique;
+    Q_FOREACH (const Key &key, keys) {
+        unique[key.first] = qMax(unique.value(key.first), key.second);
+    }
+    QList<Key> stored;
+    QHash<QString, int>::const_iterator it;
+    for (it = unique.constBegin(); it != unique.constEnd(); ++it) {
+        Posting posting;
+        posting.target = target;
+        posting.quality = it.value();
+        mKeys[it.key()].append(posting);
+        stored.append(qMakePair(it.key(), it.value()));
+    }
+    if (!stored.isEmpty()) {
+        mTargetKeys.insert(target, stored);
+    }
+    mNames.insert(target, name);
+}
+
+QList<CompletionMatch> CompletionIndex::complete(const QString &prefix, int limit) const
+{
+    QList<CompletionMatch> matches;
+    QString folded = fold(prefix);
+    if (folded.isEmpty() || limit <= 0) {
+        return matches;
+    }
+
+    QHash<quint64, int> scores;
+    QMap<QString, QVector<Posting> >::const_iterator it;
+    for (it = mKeys.lowerBound(folded); it != mKeys.constEnd() && it.key().startsWith(folded); ++it) {
+        int exact = it.key().size() == folded.size() ? 1 : 0;
+        Q_FOREACH (const Posting &posting, it.value()) {
+            int score = posting.quality * 2 + exact;
+            if (score > scores.value(posting.target)) {
+                scores.insert(posting.target, score);
+            }
+        }
+    }
+
+    // score first, more recently active conversations break ties
+    typedef QPair<QPair<int, quint64>, quint64> Ranked;
+    QVector<Ranked> ranked;
+    ranked.reserve(scores.size());
+    QHash<quint64, int>::const_iterator score;
+    for (score = scores.constBegin(); score != scores.constEnd(); ++score) {
+        ranked.append(qMakePair(qMakePair(score.value(), mWeights.value(score.key())), score.key()));
+    }
+    int count = qMin(limit, ranked.size());
+    std::partial_sort(ranked.begin(), ranked.begin() + count, ranked.end(), std::greater<Ranked>());
+    for (int i = 0; i < count; i++) {
+        quint64 target = ranked.at(i).second;
+        CompletionMatch match;
+        match.id = IdTable::toString((IdHandle)(target & 0xffffffff));
+        match.isConversation = (target >> 32) == TARGET_CONVERSATION;
+        match.name = mNames.value(target);
+        matches.append(match);
+    }
+    return matches;
+}
+
+qint64 CompletionIndex::indexBytes() const
+{
+    qint64 bytes = 0;
+    QMap<QString, QVector<Posting> >::const_iterator it;
+    for (it = mKeys.constBegin(); it != mKeys.constEnd(); ++it) {
+        bytes += it.key().capacity() * sizeof(QChar) + it->capacity() * sizeof(Posting);
+    }
+    Q_FOREACH (const QString &name, mNames) {
+        bytes += sizeof(quint64) + name.capacity() * sizeof(QChar);
+    }
+    return bytes;
+}
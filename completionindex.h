@@ -0,0 +1,63 @@
+/**
+ * libhangish
+ * Copyright (C) 2015 Tiago Salem Herrmann
+ * Copyright (C) 2015 Daniele Rogora
+ *
+ * This file is part of libhangish.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMPLETIONINDEX_H
+#define COMPLETIONINDEX_H
+
+#include <QHash>
+#include <QList>
+#include <QMap>
+#include <QPair>
+#include <QString>
+#include <QVector>
+
+#include "types.h"
+
+/*
+ * Sorted table of case folded names, first names, emails and
+ * conversation names. A prefix maps to one contiguous range of keys, the
+ * entities and conversations found there are ranked by how well the key
+ * matched and then by conversation activity.
+ */
+class CompletionIndex
+{
+
+public:
+    void setUser(IdHandle id, const ClientEntity &entity);
+    void setConversation(IdHandle id, const ClientConversation &conversation);
+    QList<CompletionMatch> complete(const QString &prefix, int limit) const;
+    qint64 indexBytes() const;
+
+private:
+    struct Posting {
+        quint64 target;
+        int quality;
+    };
+
+    void setKeys(quint64 target, const QString &name, const QList<QPair<QString, int> > &keys);
+
+    QMap<QString, QVector<Posting> > mKeys;
+    QHash<quint64, QList<QPair<QString, int> > > mTargetKeys;
+    QHash<quint64, QString> mNames;
+    QHash<quint64, quint64> mWeights;
+};
+
+#endif // COMPLETIONINDEX_H
@@ -0,0 +1,259 @@
+/**
+ * libhangish
+ * Copyright (C) 2015 Tiago Salem Herrmann
+ * Copyright (C) 2015 Daniele Rogora
+ *
+ * This file is part of libhangish.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QPair>
+#include <QVector>
+
+#include <algorithm>
+#include <functional>
+
+#include "conversationcache.h"
+#include "idtable.h"
+
+static ClientConversationState *uncompress(const QByteArray &compressed)
+{
+    QByteArray data = qUncompress(compressed);
+    ClientConversationState *state = new ClientConversationState();
+    state->ParsePartialFromArray(data.constData(), data.size());
+    return state;
+}
+
+// deleter of handed out pointers, it only drops the cache's reference
+struct KeepAlive {
+    KeepAlive(const QSharedPointer<ClientConversationState> &state) : state(state) {}
+    void operator()(const ClientConversationState *) {}
+    QSharedPointer<ClientConversationState> state;
+};
+
+ConversationCache::ConversationCache() :
+    mBudget(CONVERSATION_CACHE_BUDGET),
+    mResidentBytes(0),
+    mCompressedBytes(0),
+    mClock(0)
+{
+}
+
+void ConversationCache::setBudget(qint64 bytes)
+{
+    mBudget = bytes;
+    evict(0);
+}
+
+qint64 ConversationCache::budget() const
+{
+    return mBudget;
+}
+
+bool ConversationCache::contains(IdHandle conversation) const
+{
+    return mEntries.contains(conversation);
+}
+
+ConversationStatePtr ConversationCache::value(IdHandle conversation)
+{
+    QHash<IdHandle, Entry>::iterator it = mEntries.find(conversation);
+    if (it == mEntries.end()) {
+        return ConversationStatePtr();
+    }
+    if (!it->state) {
+        makeResident(*it);
+    }
+    touch(conversation, *it);
+    ConversationStatePtr state = handOut(*it);
+    evict(conversation);
+    return state;
+}
+
+ConversationStatePtr ConversationCache::peek(IdHandle conversation) const
+{
+    QHash<IdHandle, Entry>::const_iterator it = mEntries.constFind(conversation);
+    if (it == mEntries.constEnd()) {
+        return ConversationStatePtr();
+    }
+    return it->state ? handOut(*it) : ConversationStatePtr(uncompress(it->compressed));
+}
+
+void ConversationCache::insert(IdHandle conversation, ClientConversationState *state)
+{
+    Entry &entry = mEntries[conversation];
+    mResidentBytes -= entry.state ? entry.bytes : 0;
+    mCompressedBytes -= entry.compressed.size();
+    entry.compressed.clear();
+    entry.state = QSharedPointer<ClientConversationState>(state);
+    entry.handedOut.clear();
+    entry.bytes = 0;
+    account(entry);
+    touch(conversation, entry);
+    evict(conversation);
+}
+
+ClientConversationState *ConversationCache::detach(IdHandle conversation)
+{
+    QHash<IdHandle, Entry>::iterator it = mEntries.find(conversation);
+    if (it == mEntries.end()) {
+        return NULL;
+    }
+    if (!it->state) {
+        makeResident(*it);
+    } else if (!it->handedOut.isNull()) {
+        // someone still reads the current state, changes go to a copy
+        it->state = QSharedPointer<ClientConversationState>(new ClientConversationState(*it->state));
+        it->handedOut.clear();
+    }
+    touch(conversation, *it);
+    return it->state.data();
+}
+
+void ConversationCache::update(IdHandle conversation)
+{
+    // sizes are only known once the detached state has been changed
+    QHash<IdHandle, Entry>::iterator it = mEntries.find(conversation);
+    if (it == mEntries.end() || !it->state) {
+        return;
+    }
+    account(*it);
+    evict(conversation);
+}
+
+ConversationStatePtr ConversationCache::handOut(const Entry &entry) const
+{
+    ConversationStatePtr state = entry.handedOut.toStrongRef();
+    if (!state) {
+        state = ConversationStatePtr(entry.state.data(), KeepAlive(entry.state));
+        entry.handedOut = state;
+    }
+    return state;
+}
+
+void ConversationCache::account(Entry &entry)
+{
+    mResidentBytes -= entry.bytes;
+    entry.bytes = entry.state->SpaceUsedLong();
+    entry.sortTimestamp = entry.state->conversation().selfconversationstate().sorttimestamp();
+    mResidentBytes += entry.bytes;
+}
+
+QList<IdHandle> ConversationCache::keys() const
+{
+    return mEntries.keys();
+}
+
+ConversationCache::Iterator::Iterator(const ConversationCache &cache) :
+    mCache(&cache),
+    mIterator(cache.mEntries)
+{
+}
+
+bool ConversationCache::Iterator::hasNext() const
+{
+    return mIterator.hasNext();
+}
+
+void ConversationCache::Iterator::next()
+{
+    mIterator.next();
+}
+
+QString ConversationCache::Iterator::key() const
+{
+    return IdTable::toString(mIterator.key());
+}
+
+ConversationStatePtr ConversationCache::Iterator::value() const
+{
+    return mCache->peek(mIterator.key());
+}
+
+QList<IdHandle> ConversationCache::mostRecent(int count) const
+{
+    QVector<QPair<qint64, IdHandle> > order;
+    order.reserve(mEntries.size());
+    QHash<IdHandle, Entry>::const_iterator it;
+    for (it = mEntries.constBegin(); it != mEntries.constEnd(); ++it) {
+        order.append(qMakePair(it->sortTimestamp, it.key()));
+    }
+    count = qMin(count, order.size());
+    std::partial_sort(order.begin(), order.begin() + count, order.end(), std::greater<QPair<qint64, IdHandle> >());
+
+    QList<IdHandle> conversations;
+    for (int i = 0; i < count; i++) {
+        conversations.append(order.at(i).second);
+    }
+    return conversations;
+}
+
+int ConversationCache::size() const
+{
+    return mEntries.size();
+}
+
+qint64 ConversationCache::residentBytes() const
+{
+    return mResidentBytes;
+}
+
+qint64 ConversationCache::compressedBytes() const
+{
+    return mCompressedBytes;
+}
+
+void ConversationCache::touch(IdHandle conversation, Entry &entry)
+{
+    if (entry.lastUsed) {
+        mRecentlyUsed.remove(entry.lastUsed);
+    }
+    entry.lastUsed = ++mClock;
+    mRecentlyUsed.insert(entry.lastUsed, conversation);
+}
+
+void ConversationCache::makeResident(Entry &entry)
+{
+    entry.state = QSharedPointer<ClientConversationState>(uncompress(entry.compressed));
+    entry.handedOut.clear();
+    entry.bytes = entry.state->SpaceUsedLong();
+    mCompressedBytes -= entry.compressed.size();
+    entry.compressed.clear();
+    mResidentBytes += entry.bytes;
+}
+
+void ConversationCache::evict(IdHandle keep)
+{
+    if (mBudget <= 0) {
+        return;
+    }
+    QMap<quint64, IdHandle>::iterator it = mRecentlyUsed.begin();
+    while (mResidentBytes > mBudget && it != mRecentlyUsed.end()) {
+        if (it.value() == keep) {
+            ++it;
+            continue;
+        }
+        Entry &entry = mEntries[it.value()];
+        std::string data;
+        entry.state->SerializePartialToString(&data);
+        entry.compressed = qCompress(reinterpret_cast<const uchar *>(data.data()), data.size());
+        entry.state.clear();
+        entry.handedOut.clear();
+        entry.lastUsed = 0;
+        mResidentBytes -= entry.bytes;
+        mCompressedBytes += entry.compressed.size();
+        it = mRecentlyUsed.erase(it);
+    }
+}
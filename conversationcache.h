@@ -0,0 +1,108 @@
+/**
+ * libhangish
+ * Copyright (C) 2015 Tiago Salem Herrmann
+ * Copyright (C) 2015 Daniele Rogora
+ *
+ * This file is part of libhangish.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONVERSATIONCACHE_H
+#define CONVERSATIONCACHE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QMap>
+
+#include "types.h"
+
+/*
+ * Conversation states held within a memory budget. When the resident
+ * states grow past the budget the least recently used ones are kept only
+ * as compressed protobuf and parsed again the next time they are asked
+ * for. States already handed out stay valid, they are shared pointers;
+ * detach() copies a state before it is modified only while one of them
+ * is still held somewhere, otherwise it is changed in place. update()
+ * has to follow the changes so that the budget sees the new size.
+ */
+class ConversationCache
+{
+
+public:
+    class Iterator;
+
+    ConversationCache();
+    void setBudget(qint64 bytes);
+    qint64 budget() const;
+    bool contains(IdHandle conversation) const;
+    ConversationStatePtr value(IdHandle conversation);
+    ConversationStatePtr peek(IdHandle conversation) const;
+    void insert(IdHandle conversation, ClientConversationState *state);
+    ClientConversationState *detach(IdHandle conversation);
+    void update(IdHandle conversation);
+    QList<IdHandle> keys() const;
+    QList<IdHandle> mostRecent(int count) const;
+    int size() const;
+    qint64 residentBytes() const;
+    qint64 compressedBytes() const;
+
+private:
+    struct Entry {
+        Entry() : bytes(0), lastUsed(0), sortTimestamp(0) {}
+        QSharedPointer<ClientConversationState> state;
+        // alive while anyone outside the cache still holds the state
+        mutable QWeakPointer<const ClientConversationState> handedOut;
+        QByteArray compressed;
+        qint64 bytes;
+        quint64 lastUsed;
+        qint64 sortTimestamp;
+    };
+
+    ConversationStatePtr handOut(const Entry &entry) const;
+    void account(Entry &entry);
+    void touch(IdHandle conversation, Entry &entry);
+    void makeResident(Entry &entry);
+    void evict(IdHandle keep);
+
+    qint64 mBudget;
+    qint64 mResidentBytes;
+    qint64 mCompressedBytes;
+    quint64 mClock;
+    QHash<IdHandle, Entry> mEntries;
+    // resident conversations by last use, oldest first
+    QMap<quint64, IdHandle> mRecentlyUsed;
+};
+
+/*
+ * Java style iteration over every cached conversation. Values are peeked,
+ * so walking the cache neither counts as use nor evicts anything.
+ */
+class ConversationCache::Iterator
+{
+
+public:
+    Iterator(const ConversationCache &cache);
+    bool hasNext() const;
+    void next();
+    QString key() const;
+    ConversationStatePtr value() const;
+
+private:
+    const ConversationCache *mCache;
+    QHashIterator<IdHandle, Entry> mIterator;
+};
+
+#endif // CONVERSATIONCACHE_H
@@ -0,0 +1,130 @@
+/**
+ * libhangish
+ * Copyright (C) 2015 Tiago Salem Herrmann
+ * Copyright (C) 2015 Daniele Rogora
+ *
+ * This file is part of libhangish.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "eventdeduplicator.h"
+#include "idtable.h"
+
+EventDeduplicator::EventDeduplicator() :
+    mCurrentGeneration(0),
+    mGenerationSize(0),
+    mClock(0)
+{
+    mBloom[0].resize(DEDUP_BLOOM_BITS);
+    mBloom[1].resize(DEDUP_BLOOM_BITS);
+}
+
+bool EventDeduplicator::isNew(const ClientEvent &event, const EventStore *store)
+{
+    if (event.eventid().empty()) {
+        // nothing to recognize it by
+        mCounters.unique++;
+        return true;
+    }
+    QByteArray eventId(event.eventid().data(), event.eventid().size());
+
+    if (mRecent.contains(eventId)) {
+        remember(eventId);
+        mCounters.duplicates++;
+        return false;
+    }
+    bool bloomHit = bloomContains(eventId);
+    if (bloomHit) {
+        mCounters.bloomChecks++;
+    }
+    if (store) {
+        // events delivered before a restart are only known to the store
+        if (store->contains(IdTable::find(event.conversationid().id()), event.timestamp(), eventId)) {
+            remember(eventId);
+            mCounters.duplicates++;
+            return false;
+        }
+        if (bloomHit) {
+            mCounters.bloomFalsePositives++;
+        }
+    }
+
+    bloomInsert(eventId);
+    remember(eventId);
+    mCounters.unique++;
+    return true;
+}
+
+DedupCounters EventDeduplicator::counters() const
+{
+    return mCounters;
+}
+
+// double hashing, see Kirsch and Mitzenmacher
+static void bloomHashes(const QByteArray &eventId, uint &h1, uint &h2)
+{
+    h1 = qHash(eventId, 0x9e3779b9);
+    h2 = qHash(eventId, 0x85ebca6b) | 1;
+}
+
+bool EventDeduplicator::bloomContains(const QByteArray &eventId) const
+{
+    uint h1, h2;
+    bloomHashes(eventId, h1, h2);
+    for (int generation = 0; generation < 2; generation++) {
+        bool found = true;
+        for (int i = 0; i < DEDUP_BLOOM_HASHES && found; i++) {
+            found = mBloom[generation].testBit((h1 + i * h2) % DEDUP_BLOOM_BITS);
+        }
+        if (found) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void EventDeduplicator::bloomInsert(const QByteArray &eventId)
+{
+    if (mGenerationSize >= DEDUP_BLOOM_CAPACITY) {
+        // forget the oldest generation
+        mCurrentGeneration = 1 - mCurrentGeneration;
+        mBloom[mCurrentGeneration].fill(false);
+        mGenerationSize = 0;
+    }
+    uint h1, h2;
+    bloomHashes(eventId, h1, h2);
+    for (int i = 0; i < DEDUP_BLOOM_HASHES; i++) {
+        mBloom[mCurrentGeneration].setBit((h1 + i * h2) % DEDUP_BLOOM_BITS);
+    }
+    mGenerationSize++;
+}
+
+void EventDeduplicator::remember(const QByteArray &eventId)
+{
+    QHash<QByteArray, quint64>::iterator it = mRecent.find(eventId);
+    if (it != mRecent.end()) {
+        mRecentOrder.remove(it.value());
+        it.value() = ++mClock;
+    } else {
+        mRecent.insert(eventId, ++mClock);
+    }
+    mRecentOrder.insert(mClock, eventId);
+
+    if (mRecent.size() > DEDUP_RECENT_EVENTS) {
+        QMap<quint64, QByteArray>::iterator oldest = mRecentOrder.begin();
+        mRecent.remove(oldest.value());
+        mRecentOrder.erase(oldest);
+    }
+}
@@ -0,0 +1,62 @@
+/**
+ * libhangish
+ * Copyright (C) 2015 Tiago Salem Herrmann
+ * Copyright (C) 2015 Daniele Rogora
+ *
+ * This file is part of libhangish.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVENTDEDUPLICATOR_H
+#define EVENTDEDUPLICATOR_H
+
+#include <QBitArray>
+#include <QByteArray>
+#include <QHash>
+#include <QMap>
+
+#include "eventstore.h"
+#include "types.h"
+
+/*
+ * Remembers which events have already been delivered. Recent event ids
+ * are kept exactly in a small LRU; older ones only in a two generation
+ * Bloom filter of fixed size. Both start empty on every launch, so every
+ * event the LRU does not know is checked against the event store when
+ * there is one; a false positive never drops an event.
+ */
+class EventDeduplicator
+{
+
+public:
+    EventDeduplicator();
+    bool isNew(const ClientEvent &event, const EventStore *store);
+    DedupCounters counters() const;
+
+private:
+    bool bloomContains(const QByteArray &eventId) const;
+    void bloomInsert(const QByteArray &eventId);
+    void remember(const QByteArray &eventId);
+
+    QBitArray mBloom[2];
+    int mCurrentGeneration;
+    int mGenerationSize;
+    quint64 mClock;
+    QHash<QByteArray, quint64> mRecent;
+    QMap<quint64, QByteArray> mRecentOrder;
+    DedupCounters mCounters;
+};
+
+#endif // EVENTDEDUPLICATOR_H
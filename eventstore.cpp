@@ -0,0 +1,322 @@
+/**
+ * libhangish
+ * Copyright (C) 2015 Tiago Salem Herrmann
+ * Copyright (C) 2015 Daniele Rogora
+ *
+ * This file is part of libhangish.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QDebug>
+#include <QDir>
+
+#include <algorithm>
+#include <string.h>
+
+#include "eventstore.h"
+#include "idtable.h"
+
+#define RECORD_MAGIC 0x54564548
+
+EventStore::EventStore(const QString &path) :
+    mPath(path),
+    mWriteOffset(0),
+    mNewestTimestamp(0)
+{
+}
+
+EventStore::~EventStore()
+{
+    Q_FOREACH (const Segment &segment, mSegments) {
+        segment.file->unmap(segment.data);
+        segment.file->close();
+        delete segment.file;
+    }
+}
+
+bool EventStore::open()
+{
+    QDir dir(mPath);
+    if (!dir.mkpath(".")) {
+        qDebug() << "Could not create event store at" << mPath;
+        return false;
+    }
+
+    int segments = segmentFiles(mPath).size();
+    for (int i = 0; i < segments; i++) {
+        if (!openSegment(i)) {
+            return false;
+        }
+        mWriteOffset = scanSegment(i);
+    }
+    if (mSegments.isEmpty()) {
+        mWriteOffset = 0;
+        return openSegment(0);
+    }
+    qDebug() << "Event store opened with" << mIndex.size() << "conversations";
+    return true;
+}
+
+QString EventStore::path() const
+{
+    return mPath;
+}
+
+QStringList EventStore::segmentFiles(const QString &path)
+{
+    QDir dir(path);
+    QStringList files;
+    Q_FOREACH (const QString &name, dir.entryList(QStringList() << "segment-*.log", QDir::Files, QDir::Name)) {
+        files.append(dir.filePath(name));
+    }
+    return files;
+}
+
+QList<ClientEvent> EventStore::readSegment(const QString &fileName)
+{
+    // independent of any open store, safe to use from another thread
+    QList<ClientEvent> events;
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly) || file.size() < (qint64)sizeof(RecordHeader)) {
+        return events;
+    }
+    qint64 size = file.size();
+    const uchar *data = file.map(0, size);
+    if (!data) {
+        return events;
+    }
+    qint64 offset = 0;
+    while (offset + (qint64)sizeof(RecordHeader) <= size) {
+        RecordHeader header;
+        memcpy(&header, data + offset, sizeof(RecordHeader));
+        if (header.magic != RECORD_MAGIC) {
+            break;
+        }
+        qint64 bodyLength = header.conversationIdLength + header.eventIdLength + header.payloadLength;
+        if (offset + (qint64)sizeof(RecordHeader) + bodyLength > size) {
+            break;
+        }
+        const char *body = reinterpret_cast<const char *>(data + offset + sizeof(RecordHeader));
+        if (qChecksum(body, bodyLength) != header.checksum) {
+            break;
+        }
+        ClientEvent event;
+        if (event.ParsePartialFromArray(body + header.conversationIdLength + header.eventIdLength, header.payloadLength)) {
+            events.append(event);
+        }
+        offset += sizeof(RecordHeader) + bodyLength;
+    }
+    file.unmap(const_cast<uchar *>(data));
+    return events;
+}
+
+bool EventStore::openSegment(int number)
+{
+    QFile *file = new QFile(QDir(mPath).filePath(QString("segment-%1.log").arg(number, 6, 10, QChar('0'))));
+    if (!file->open(QIODevice::ReadWrite)) {
+        qDebug() << "Could not open event store segment" << file->fileName();
+        delete file;
+        return false;
+    }
+    if (file->size() < EVENT_STORE_SEGMENT_SIZE) {
+        file->resize(EVENT_STORE_SEGMENT_SIZE);
+    }
+    uchar *data = file->map(0, EVENT_STORE_SEGMENT_SIZE);
+    if (!data) {
+        qDebug() << "Could not map event store segment" << file->fileName();
+        delete file;
+        return false;
+    }
+    Segment segment;
+    segment.file = file;
+    segment.data = data;
+    mSegments.append(segment);
+    return true;
+}
+
+qint64 EventStore::scanSegment(int segment)
+{
+    const uchar *data = mSegments.at(segment).data;
+    qint64 offset = 0;
+    while (offset + (qint64)sizeof(RecordHeader) <= EVENT_STORE_SEGMENT_SIZE) {
+        RecordHeader header;
+        memcpy(&header, data + offset, sizeof(RecordHeader));
+        if (header.magic != RECORD_MAGIC) {
+            break;
+        }
+        qint64 bodyLength = header.conversationIdLength + header.eventIdLength + header.payloadLength;
+        if (offset + (qint64)sizeof(RecordHeader) + bodyLength > EVENT_STORE_SEGMENT_SIZE) {
+            break;
+        }
+        const char *body = reinterpret_cast<const char *>(data + offset + sizeof(RecordHeader));
+        if (qChecksum(body, bodyLength) != header.checksum) {
+            // torn write at the tail, the next append overwrites it
+            break;
+        }
+
+        Locator locator;
+        locator.timestamp = header.timestamp;
+        locator.segment = segment;
+        locator.offset = offset;
+        index(IdTable::intern(body, header.conversationIdLength), locator);
+        mNewestTimestamp = qMax(mNewestTimestamp, header.timestamp);
+        offset += sizeof(RecordHeader) + bodyLength;
+    }
+    return offset;
+}
+
+void EventStore::index(IdHandle conversation, const Locator &locator)
+{
+    QVector<Locator> &locators = mIndex[conversation];
+    if (locators.isEmpty() || !(locator < locators.last())) {
+        locators.append(locator);
+    } else {
+        locators.insert(std::upper_bound(locators.begin(), locators.end(), locator), locator);
+    }
+}
+
+bool EventStore::append(const ClientEvent &event)
+{
+    if (mSegments.isEmpty() || !event.has_conversationid() || event.eventid().empty()) {
+        return false;
+    }
+    const std::string &conversationId = event.conversationid().id();
+    const std::string &eventId = event.eventid();
+    IdHandle conversation = IdTable::intern(conversationId);
+    if (contains(conversation, event.timestamp(), QByteArray::fromRawData(eventId.data(), eventId.size()))) {
+        return false;
+    }
+
+    std::string payload;
+    event.SerializePartialToString(&payload);
+    qint64 bodyLength = conversationId.size() + eventId.size() + payload.size();
+    qint64 recordLength = sizeof(RecordHeader) + bodyLength;
+    if (recordLength > EVENT_STORE_SEGMENT_SIZE) {
+        return false;
+    }
+    if (mWriteOffset + recordLength > EVENT_STORE_SEGMENT_SIZE) {
+        if (!openSegment(mSegments.size())) {
+            return false;
+        }
+        mWriteOffset = 0;
+    }
+
+    uchar *record = mSegments.last().data + mWriteOffset;
+    char *body = reinterpret_cast<char *>(record + sizeof(RecordHeader));
+    memcpy(body, conversationId.data(), conversationId.size());
+    memcpy(body + conversationId.size(), eventId.data(), eventId.size());
+    memcpy(body + conversationId.size() + eventId.size(), payload.data(), payload.size());
+
+    RecordHeader header;
+    header.magic = RECORD_MAGIC;
+    header.payloadLength = payload.size();
+    header.timestamp = event.timestamp();
+    header.conversationIdLength = conversationId.size();
+    header.eventIdLength = eventId.size();
+    header.checksum = qChecksum(body, bodyLength);
+    header.reserved = 0;
+    memcpy(record, &header, sizeof(RecordHeader));
+
+    Locator locator;
+    locator.timestamp = header.timestamp;
+    locator.segment = mSegments.size() - 1;
+    locator.offset = mWriteOffset;
+    index(conversation, locator);
+    mNewestTimestamp = qMax(mNewestTimestamp, header.timestamp);
+    mWriteOffset += recordLength;
+    return true;
+}
+
+QByteArray EventStore::eventIdAt(const Locator &locator) const
+{
+    const uchar *record = mSegments.at(locator.segment).data + locator.offset;
+    RecordHeader header;
+    memcpy(&header, record, sizeof(RecordHeader));
+    return QByteArray::fromRawData(reinterpret_cast<const char *>(record + sizeof(RecordHeader) + header.conversationIdLength),
+                                   header.eventIdLength);
+}
+
+bool EventStore::eventAt(const Locator &locator, ClientEvent &event) const
+{
+    const uchar *record = mSegments.at(locator.segment).data + locator.offset;
+    RecordHeader header;
+    memcpy(&header, record, sizeof(RecordHeader));
+    const uchar *payload = record + sizeof(RecordHeader) + header.conversationIdLength + header.eventIdLength;
+    return event.ParsePartialFromArray(payload, header.payloadLength);
+}
+
+bool EventStore::contains(const QString &conversationId, quint64 timestamp, const QString &eventId) const
+{
+    return contains(IdTable::find(conversationId), timestamp, eventId.toUtf8());
+}
+
+bool EventStore::contains(IdHandle conversation, quint64 timestamp, const QByteArray &eventId) const
+{
+    QHash<IdHandle, QVector<Locator> >::const_iterator it = mIndex.constFind(conversation);
+    if (it == mIndex.constEnd()) {
+        return false;
+    }
+    Locator key;
+    key.timestamp = timestamp;
+    key.segment = 0;
+    key.offset = 0;
+    QVector<Locator>::const_iterator locator = std::lower_bound(it->constBegin(), it->constEnd(), key);
+    for (; locator != it->constEnd() && locator->timestamp == timestamp; ++locator) {
+        if (eventIdAt(*locator) == eventId) {
+            return true;
+        }
+    }
+    return false;
+}
+
+QList<ClientEvent> EventStore::lastEvents(const QString &conversationId, int count) const
+{
+    QList<ClientEvent> events;
+    QHash<IdHandle, QVector<Locator> >::const_iterator it = mIndex.constFind(IdTable::find(conversationId));
+    if (it == mIndex.constEnd()) {
+        return events;
+    }
+    for (int i = qMax(0, it->size() - count); i < it->size(); i++) {
+        ClientEvent event;
+        if (eventAt(it->at(i), event)) {
+            events.append(event);
+        }
+    }
+    return events;
+}
+
+quint64 EventStore::newestTimestamp() const
+{
+    return mNewestTimestamp;
+}
+
+quint64 EventStore::newestTimestamp(const QString &conversationId) const
+{
+    QHash<IdHandle, QVector<Locator> >::const_iterator it = mIndex.constFind(IdTable::find(conversationId));
+    if (it == mIndex.constEnd() || it->isEmpty()) {
+        return 0;
+    }
+    return it->last().timestamp;
+}
+
+qint64 EventStore::indexBytes() const
+{
+    qint64 bytes = 0;
+    QHash<IdHandle, QVector<Locator> >::const_iterator it;
+    for (it = mIndex.constBegin(); it != mIndex.constEnd(); ++it) {
+        bytes += sizeof(IdHandle) + it->capacity() * sizeof(Locator);
+    }
+    return bytes;
+}
@@ -0,0 +1,94 @@
+/**
+ * libhangish
+ * Copyright (C) 2015 Tiago Salem Herrmann
+ * Copyright (C) 2015 Daniele Rogora
+ *
+ * This file is part of libhangish.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVENTSTORE_H
+#define EVENTSTORE_H
+
+#include <QFile>
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+#include "types.h"
+
+/*
+ * Append-only log of ClientEvents. Records are written to fixed size,
+ * memory mapped segment files; only a compact locator per event is kept
+ * in memory, ordered by timestamp for each conversation.
+ */
+class EventStore
+{
+
+public:
+    EventStore(const QString &path);
+    ~EventStore();
+    bool open();
+    bool append(const ClientEvent &event);
+    bool contains(const QString &conversationId, quint64 timestamp, const QString &eventId) const;
+    bool contains(IdHandle conversation, quint64 timestamp, const QByteArray &eventId) const;
+    QList<ClientEvent> lastEvents(const QString &conversationId, int count) const;
+    quint64 newestTimestamp() const;
+    quint64 newestTimestamp(const QString &conversationId) const;
+    qint64 indexBytes() const;
+    QString path() const;
+
+    static QStringList segmentFiles(const QString &path);
+    static QList<ClientEvent> readSegment(const QString &fileName);
+
+private:
+    struct RecordHeader {
+        quint32 magic;
+        quint32 payloadLength;
+        quint64 timestamp;
+        quint16 conversationIdLength;
+        quint16 eventIdLength;
+        quint16 checksum;
+        quint16 reserved;
+    };
+
+    struct Locator {
+        bool operator<(const Locator &other) const { return timestamp < other.timestamp; }
+        quint64 timestamp;
+        quint32 segment;
+        quint32 offset;
+    };
+
+    struct Segment {
+        QFile *file;
+        uchar *data;
+    };
+
+    bool openSegment(int number);
+    qint64 scanSegment(int segment);
+    void index(IdHandle conversation, const Locator &locator);
+    QByteArray eventIdAt(const Locator &locator) const;
+    bool eventAt(const Locator &locator, ClientEvent &event) const;
+
+    QString mPath;
+    QList<Segment> mSegments;
+    qint64 mWriteOffset;
+    quint64 mNewestTimestamp;
+    QHash<IdHandle, QVector<Locator> > mIndex;
+};
+
+#endif // EVENTSTORE_H
@@ -22,10 +22,20 @@
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QFile>
+#include <QSaveFile>
+#include <QElapsedTimer>
 #include <QJsonArray>
 #include <QUrlQuery>
+#include <QHash>
+#include <QSet>
+#include <QTimer>
+#include <QVector>
+#include <qmath.h>
+
+#include <algorithm>
 
 #include "hangishclient.h"
+#include "idtable.h"
 #include "channel.h"
 
 HangishClient::HangishClient(const QString &pCookiePath) :
@@ -34,16 +44,57 @@ HangishClient::HangishClient(const QString &pCookiePath) :
     mLastKnownPushTs(0),
     mCookiePath(pCookiePath),
     mAuthenticator(new Authenticator(mCookiePath)),
-    mChannel(NULL)
+    mChannel(NULL),
+    mHedgingEnabled(false),
+    mImageUploader(new ImageUploader(mSessionCookies)),
+    mEventStore(NULL),
+    mSearchIndex(NULL),
+    mLastSyncTimestamp(0),
+    mUsingCachedInit(false),
+    mHistoryPrefetchWindow(HISTORY_PREFETCH_PAGES),
+    mCatchUpsInFlight(0),
+    mSyncResponseStates(false),
+    mTotalUnread(0)
 {
     QObject::connect(mAuthenticator, SIGNAL(gotCookies(QMap<QString,QNetworkCookie>)), this, SLOT(onAuthenticationDone(QMap<QString,QNetworkCookie>)));
     QObject::connect(mAuthenticator, SIGNAL(loginNeeded()), this, SIGNAL(loginNeeded()));
     QObject::connect(mAuthenticator, SIGNAL(authFailed(AuthenticationStatus,QString)), this, SIGNAL(authFailed(AuthenticationStatus,QString)));
     qsrand((uint)QTime::currentTime().msec());
     mCurrentRequestId = qrand();
+    mRequestTimeouts["conversations/syncallnewevents"] = SYNC_REQUEST_TIMEOUT_MSECS;
+    mPresenceBatchTimer.setSingleShot(true);
+    QObject::connect(&mPresenceBatchTimer, SIGNAL(timeout()), this, SLOT(flushPresenceQueries()));
+    mEntityBatchTimer.setSingleShot(true);
+    QObject::connect(&mEntityBatchTimer, SIGNAL(timeout()), this, SLOT(flushEntityLookups()));
+    mWatermarkTimer.setSingleShot(true);
+    QObject::connect(&mWatermarkTimer, SIGNAL(timeout()), this, SLOT(flushWatermarks()));
+    mGapCheckTimer.setSingleShot(true);
+    QObject::connect(&mGapCheckTimer, SIGNAL(timeout()), this, SLOT(flushGapChecks()));
+    QObject::connect(mImageUploader, SIGNAL(uploadProgress(quint64,qint64,qint64)), this, SIGNAL(imageUploadProgress(quint64,qint64,qint64)));
+    QObject::connect(mImageUploader, SIGNAL(uploadFinished(quint64,QString,QString)), this, SLOT(onImageUploaded(quint64,QString,QString)));
+    QObject::connect(mImageUploader, SIGNAL(uploadFailed(quint64)), this, SLOT(onImageUploadFailed(quint64)));
+
+    // cached users and conversations are available before connecting
+    loadSnapshot();
+    QObject::connect(&mSnapshotTimer, SIGNAL(timeout()), this, SLOT(onSnapshotTimeout()));
+    mSnapshotTimer.start(SNAPSHOT_INTERVAL_SECS * 1000);
+}
+
+HangishClient::~HangishClient()
+{
+    saveSnapshot();
+    delete mImageUploader;
+    delete mEventStore;
+    delete mSearchIndex;
 }
 
 void HangishClient::initDone()
+{
+    startPhase(BOOTSTRAP_SYNC);
+    startPhase(BOOTSTRAP_CHANNEL_SID);
+}
+
+void HangishClient::startChannel()
 {
     if (mChannel) {
         hangishDisconnect();
@@ -54,18 +105,184 @@ void HangishClient::initDone()
     QObject::connect(mChannel, SIGNAL(updateClientId(QString)), this, SLOT(updateClientId(QString)));
     QObject::connect(mChannel, SIGNAL(cookieUpdateNeeded(QNetworkCookie)), this, SLOT(cookieUpdateSlot(QNetworkCookie)));
     QObject::connect(mChannel, SIGNAL(clientBatchUpdate(ClientBatchUpdate&)), this, SLOT(onClientBatchUpdate(ClientBatchUpdate&)));
-
-    syncAllNewEvents(mLastKnownPushTs);
     mChannel->listen();
 }
 
+static QList<BootstrapPhase> bootstrapDependencies(BootstrapPhase phase)
+{
+    QList<BootstrapPhase> dependencies;
+    switch (phase) {
+    case BOOTSTRAP_PVT_TOKEN:
+        dependencies << BOOTSTRAP_AUTHENTICATION;
+        break;
+    case BOOTSTRAP_INIT_PAGE:
+        dependencies << BOOTSTRAP_PVT_TOKEN;
+        break;
+    case BOOTSTRAP_SYNC:
+    case BOOTSTRAP_CHANNEL_SID:
+    case BOOTSTRAP_INIT_DECODE:
+        // sync and channel only need the api key and headers, not users and conversations
+        dependencies << BOOTSTRAP_INIT_PAGE;
+        break;
+    case BOOTSTRAP_CHANNEL_POLL:
+        dependencies << BOOTSTRAP_CHANNEL_SID;
+        break;
+    default:
+        break;
+    }
+    return dependencies;
+}
+
+static const char *bootstrapPhaseName(BootstrapPhase phase)
+{
+    switch (phase) {
+    case BOOTSTRAP_AUTHENTICATION:
+        return "authentication";
+    case BOOTSTRAP_PVT_TOKEN:
+        return "pvtToken";
+    case BOOTSTRAP_INIT_PAGE:
+        return "initPage";
+    case BOOTSTRAP_SYNC:
+        return "sync";
+    case BOOTSTRAP_CHANNEL_SID:
+        return "channelSid";
+    case BOOTSTRAP_CHANNEL_POLL:
+        return "channelPoll";
+    case BOOTSTRAP_INIT_DECODE:
+        return "initDecode";
+    default:
+        return "unknown";
+    }
+}
+
+void HangishClient::startPhase(BootstrapPhase phase)
+{
+    mBootstrapPhases[phase].startedAt = mConnectTimer.elapsed();
+    mBootstrapPhases[phase].finishedAt = -1;
+    mBootstrapPhases[phase].skipped = false;
+
+    switch (phase) {
+    case BOOTSTRAP_AUTHENTICATION:
+        mAuthenticator->authenticate();
+        break;
+    case BOOTSTRAP_PVT_TOKEN:
+        getPVTToken();
+        break;
+    case BOOTSTRAP_INIT_PAGE:
+        initChat(mPvtToken);
+        break;
+    case BOOTSTRAP_SYNC: {
+        // only fetch what happened after the newest event we already have
+        quint64 syncFrom = qMax(mLastKnownPushTs, mLastSyncTimestamp);
+        if (mEventStore && mEventStore->newestTimestamp() > syncFrom) {
+            syncFrom = mEventStore->newestTimestamp();
+        }
+        syncAllNewEvents(syncFrom);
+        break;
+    }
+    case BOOTSTRAP_CHANNEL_SID:
+        startChannel();
+        break;
+    case BOOTSTRAP_CHANNEL_POLL:
+        // the channel starts polling by itself once it has a sid
+        break;
+    case BOOTSTRAP_INIT_DECODE:
+        decodeInitData();
+        finishPhase(BOOTSTRAP_INIT_DECODE);
+        break;
+    default:
+        break;
+    }
+}
+
+void HangishClient::finishPhase(BootstrapPhase phase)
+{
+    BootstrapPhaseState &state = mBootstrapPhases[phase];
+    if (state.startedAt < 0 || state.finishedAt >= 0) {
+        return;
+    }
+    state.finishedAt = mConnectTimer.elapsed();
+    startReadyPhases();
+
+    for (int i = 0; i < BOOTSTRAP_PHASE_COUNT; i++) {
+        if (mBootstrapPhases[i].finishedAt < 0) {
+            return;
+        }
+    }
+    QVariantMap profile = startupProfile();
+    qDebug() << "Startup profile" << profile;
+    Q_EMIT startupProfileReady(profile);
+}
+
+void HangishClient::skipPhase(BootstrapPhase phase)
+{
+    mBootstrapPhases[phase].startedAt = mConnectTimer.elapsed();
+    mBootstrapPhases[phase].finishedAt = mBootstrapPhases[phase].startedAt;
+    mBootstrapPhases[phase].skipped = true;
+}
+
+void HangishClient::startReadyPhases()
+{
+    for (int i = 0; i < BOOTSTRAP_PHASE_COUNT; i++) {
+        BootstrapPhase phase = static_cast<BootstrapPhase>(i);
+        if (mBootstrapPhases[phase].startedAt >= 0) {
+            continue;
+        }
+        bool ready = true;
+        Q_FOREACH (BootstrapPhase dependency, bootstrapDependencies(phase)) {
+            if (mBootstrapPhases[dependency].finishedAt < 0) {
+                ready = false;
+                break;
+            }
+        }
+        if (ready) {
+            startPhase(phase);
+        }
+    }
+}
+
+void HangishClient::resetBootstrap(BootstrapPhase from)
+{
+    for (int i = from; i < BOOTSTRAP_PHASE_COUNT; i++) {
+        mBootstrapPhases[i] = BootstrapPhaseState();
+    }
+}
+
+QVariantMap HangishClient::startupProfile() const
+{
+    QVariantMap profile;
+    qint64 total = 0;
+    for (int i = 0; i < BOOTSTRAP_PHASE_COUNT; i++) {
+        const BootstrapPhaseState &state = mBootstrapPhases[i];
+        QVariantMap phase;
+        phase["start"] = state.startedAt;
+        phase["end"] = state.finishedAt;
+        phase["duration"] = state.finishedAt - state.startedAt;
+        phase["skipped"] = state.skipped;
+        profile[bootstrapPhaseName(static_cast<BootstrapPhase>(i))] = phase;
+        total = qMax(total, state.finishedAt);
+    }
+    profile["total"] = total;
+    profile["warmStart"] = mUsingCachedInit;
+    return profile;
+}
+
 void HangishClient::onChannelStatusChanged(Channel::ChannelStatus status)
 {
     switch(status) {
     case Channel::ChannelStatusConnecting:
         Q_EMIT connectionStatusChanged(CONNECTION_STATUS_CONNECTING);
         break;
+    case Channel::ChannelStatusActive:
+        finishPhase(BOOTSTRAP_CHANNEL_POLL);
+        break;
     case Channel::ChannelStatusPermanentError:
+        if (mUsingCachedInit && mClid.isEmpty()) {
+            // the cached values could not bring the channel up
+            discardInitCache();
+            return;
+        }
+        // fall through
     case Channel::ChannelStatusInactive:
         Q_EMIT connectionStatusChanged(CONNECTION_STATUS_DISCONNECTED);
         break;
@@ -85,7 +302,9 @@ void HangishClient::hangishConnect(quint64 lastKnownPushTs)
     mNetworkAccessManager.setCookieJar(new QNetworkCookieJar(this));
     mSessionCookies.clear();
     mLastKnownPushTs = lastKnownPushTs;
-    mAuthenticator->authenticate();
+    mConnectTimer.start();
+    resetBootstrap();
+    startPhase(BOOTSTRAP_AUTHENTICATION);
 }
 
 QString HangishClient::getSelfChatId() const
@@ -101,19 +320,242 @@ ClientEntity HangishClient::getMyself() const
     return mMyself;
 }
 
-QMap<QString, ClientEntity> HangishClient::getUsers() const
+IdHashIterator<ClientEntityPtr> HangishClient::getUsers() const
+{
+    return IdHashIterator<ClientEntityPtr>(mUsers);
+}
+
+void HangishClient::setRequestTimeout(const QString &function, int msecs)
+{
+    mRequestTimeouts[function] = msecs;
+}
+
+void HangishClient::setHedgingEnabled(bool enabled)
+{
+    mHedgingEnabled = enabled;
+}
+
+ActivityCounters HangishClient::getActivityCounters() const
+{
+    return mActivityCounters;
+}
+
+void HangishClient::setImagePreprocessingOptions(const ImagePreprocessingOptions &options)
+{
+    mImageUploader->setPreprocessingOptions(options);
+}
+
+bool HangishClient::setEventStorePath(const QString &path)
+{
+    delete mEventStore;
+    mEventStore = new EventStore(path);
+    if (!mEventStore->open()) {
+        delete mEventStore;
+        mEventStore = NULL;
+        return false;
+    }
+    return true;
+}
+
+QList<ClientEvent> HangishClient::getLastEvents(const QString &convId, int count) const
+{
+    if (!mEventStore) {
+        return QList<ClientEvent>();
+    }
+    return mEventStore->lastEvents(convId, count);
+}
+
+bool HangishClient::setSearchIndexPath(const QString &path)
+{
+    delete mSearchIndex;
+    mSearchIndex = new SearchIndex(path);
+    if (!mSearchIndex->open(mEventStore ? mEventStore->path() : QString())) {
+        delete mSearchIndex;
+        mSearchIndex = NULL;
+        return false;
+    }
+    return true;
+}
+
+QList<CompletionMatch> HangishClient::autocomplete(const QString &prefix, int limit) const
+{
+    return mCompletions.complete(prefix, limit);
+}
+
+QList<SearchHit> HangishClient::searchEvents(const QString &query, const QString &convId, int limit) const
+{
+    if (!mSearchIndex) {
+        return QList<SearchHit>();
+    }
+    return mSearchIndex->search(query, convId, limit);
+}
+
+void HangishClient::deliverEvents(const ClientConversationState &state)
+{
+    for (int i = 0; i < state.event_size(); i++) {
+        deliverEvent(state.event(i));
+    }
+}
+
+void HangishClient::deliverEvent(const ClientEvent &event)
+{
+    // checked before appending, the store is what confirms Bloom hits
+    if (mDeduplicator.isNew(event, mEventStore)) {
+        IdHandle convId = IdTable::intern(event.conversationid().id());
+        if (event.timestamp() > lastEventTimestamp(convId)) {
+            mLastEventTimestamps[convId] = event.timestamp();
+        }
+        // senders outside the contact list get looked up in the background
+        if (event.senderid().has_chatid()) {
+            queueEntityLookup(IdTable::intern(event.senderid().chatid()));
+        }
+        if (mSearchIndex) {
+            mSearchIndex->add(event);
+        }
+        ClientEvent delivered = event;
+        Q_EMIT newEvent(delivered);
+    }
+    if (mEventStore) {
+        mEventStore->append(event);
+    }
+}
+
+DedupCounters HangishClient::getDedupCounters() const
+{
+    return mDeduplicator.counters();
+}
+
+bool HangishClient::loadSnapshot()
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    QFile snapshotFile(mCookiePath + ".snapshot");
+    if (!snapshotFile.open(QIODevice::ReadOnly) || snapshotFile.size() == 0) {
+        return false;
+    }
+    uchar *data = snapshotFile.map(0, snapshotFile.size());
+    if (!data) {
+        return false;
+    }
+    HangishSnapshot snapshot;
+    bool parsed = snapshot.ParsePartialFromArray(data, snapshotFile.size());
+    snapshotFile.unmap(data);
+    if (!parsed || snapshot.version() != SNAPSHOT_VERSION) {
+        qDebug() << "Ignoring invalid snapshot";
+        return false;
+    }
+
+    mMyself = snapshot.myself();
+    for (int i = 0; i < snapshot.user_size(); i++) {
+        const ClientEntity &entity = snapshot.user(i);
+        IdHandle id = IdTable::intern(entity.id().chatid());
+        mUsers[id] = ClientEntityPtr(new ClientEntity(entity));
+        mCompletions.setUser(id, entity);
+    }
+    for (int i = 0; i < snapshot.conversation_size(); i++) {
+        const ClientConversationState &conv = snapshot.conversation(i);
+        IdHandle convId = IdTable::intern(conv.conversationid().id());
+        mConversations.insert(convId, new ClientConversationState(conv));
+        indexParticipants(convId, conv.conversation());
+        mCompletions.setConversation(convId, conv.conversation());
+        seedUnreadState(convId, conv);
+    }
+    mLastSyncTimestamp = snapshot.synctimestamp();
+    qDebug() << "Loaded snapshot with" << mUsers.size() << "users and" << mConversations.size() << "conversations in" << timer.elapsed() << "ms";
+    return true;
+}
+
+bool HangishClient::saveSnapshot()
+{
+    if (!mMyself.has_id()) {
+        return false;
+    }
+
+    HangishSnapshot snapshot;
+    snapshot.set_version(SNAPSHOT_VERSION);
+    snapshot.mutable_myself()->CopyFrom(mMyself);
+    Q_FOREACH (const ClientEntityPtr &entity, mUsers) {
+        snapshot.add_user()->CopyFrom(*entity);
+    }
+    // evicted conversations are written without making them resident again
+    Q_FOREACH (IdHandle convId, mConversations.keys()) {
+        snapshot.add_conversation()->CopyFrom(*mConversations.peek(convId));
+    }
+    snapshot.set_synctimestamp(mLastSyncTimestamp);
+
+    std::string data;
+    snapshot.SerializePartialToString(&data);
+    QSaveFile snapshotFile(mCookiePath + ".snapshot");
+    if (!snapshotFile.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    snapshotFile.write(data.data(), data.size());
+    return snapshotFile.commit();
+}
+
+void HangishClient::onSnapshotTimeout()
+{
+    saveSnapshot();
+}
+
+ClientEntityPtr HangishClient::getUserById(const QString &chatId) const
+{
+    return mUsers.value(IdTable::find(chatId));
+}
+
+ClientEntityPtr HangishClient::getParticipant(const QString &convId, const QString &chatId) const
+{
+    IdHandle id = IdTable::find(chatId);
+    ClientEntityPtr user = mUsers.value(id);
+    if (user) {
+        return user;
+    }
+    // not resolved yet, fall back to what the conversation knows about them
+    QHash<IdHandle, QHash<IdHandle, ClientEntityPtr> >::const_iterator it = mParticipants.constFind(IdTable::find(convId));
+    if (it == mParticipants.constEnd()) {
+        return ClientEntityPtr();
+    }
+    return it->value(id);
+}
+
+ConversationStatePtr HangishClient::getConvById(const QString &convId) const
 {
-    return mUsers;
+    return mConversations.value(IdTable::find(convId));
 }
 
-ClientEntity HangishClient::getUserById(const QString &chatId) const
+ConversationCache::Iterator HangishClient::getConversations() const
 {
-    return mUsers[chatId];
+    return ConversationCache::Iterator(mConversations);
 }
 
-ClientConversationState HangishClient::getConvById(const QString &convId) const
+void HangishClient::setConversationCacheBudget(qint64 bytes)
 {
-    return mConversations[convId];
+    mConversations.setBudget(bytes);
+}
+
+QVariantMap HangishClient::memoryUsage() const
+{
+    qint64 users = 0;
+    Q_FOREACH (const ClientEntityPtr &entity, mUsers) {
+        users += entity->SpaceUsedLong();
+    }
+    QVariantMap usage;
+    qint64 participants = 0;
+    Q_FOREACH (const QHash<IdHandle, ClientEntityPtr> &index, mParticipants) {
+        Q_FOREACH (const ClientEntityPtr &entity, index) {
+            participants += entity->SpaceUsedLong();
+        }
+    }
+    usage["users"] = users;
+    usage["participantIndex"] = participants;
+    usage["completionIndex"] = mCompletions.indexBytes();
+    usage["conversations"] = mConversations.residentBytes();
+    usage["conversationsCompressed"] = mConversations.compressedBytes();
+    usage["eventStoreIndex"] = mEventStore ? mEventStore->indexBytes() : 0;
+    usage["searchIndex"] = mSearchIndex ? mSearchIndex->indexBytes() : 0;
+    usage["idTable"] = IdTable::bytes();
+    return usage;
 }
 
 QByteArray HangishClient::getAuthHeader() const
@@ -135,21 +577,20 @@ QByteArray HangishClient::getAuthHeader() const
     return res;
 }
 
-void HangishClient::performImageUpload(const QString &url)
+QNetworkReply *HangishClient::sendRequest(const QString &function, const QString &json, QNetworkRequest::Priority priority)
 {
-    OutgoingImage oi = mOutgoingImages.at(0);
-
-    QFile inFile(oi.filename);
-    if (!inFile.open(QIODevice::ReadOnly)) {
-        qDebug() << "File not found";
-        return ;
-    }
+    QUrl url(ENDPOINT_URL + function);
+    QUrlQuery query;
+    query.addQueryItem("alt", "protojson");
+    query.addQueryItem("key", mApiKey);
+    url.setQuery(query);
 
     QNetworkRequest req(url);
-    req.setRawHeader("User-Agent", USER_AGENT);
-    req.setRawHeader("X-GUploader-Client-Info", "mechanism=scotty xhr resumable; clientVersion=82480166");
-    req.setRawHeader("content-type", "application/x-www-form-urlencoded;charset=utf-8");
-    req.setRawHeader("Content-Length", QByteArray::number(inFile.size()));
+    req.setRawHeader("authorization", getAuthHeader());
+    req.setRawHeader("x-origin", QByteArray(ORIGIN_URL));
+    req.setRawHeader("x-goog-authuser", "0");
+    req.setRawHeader("content-type", "application/json+protobuf");
+    req.setPriority(priority);
 
     QList<QNetworkCookie> reqCookies;
     Q_FOREACH (QNetworkCookie cookie, mSessionCookies) {
@@ -158,73 +599,121 @@ void HangishClient::performImageUpload(const QString &url)
         }
     }
     req.setHeader(QNetworkRequest::CookieHeader, QVariant::fromValue(reqCookies));
-    QNetworkReply * reply = mNetworkAccessManager.post(req, inFile.readAll());
-    QObject::connect(reply, SIGNAL(finished()), this, SLOT(uploadPerformedReply()));
+    QByteArray postData;
+    postData.append(json);
+    QNetworkReply *reply = mNetworkAccessManager.post(req, postData);
+    reply->setProperty("hangishFunction", function);
+    reply->setProperty("hangishStartTime", QDateTime::currentMSecsSinceEpoch());
+
+    // the timer is owned by the reply, so it goes away together with it
+    QTimer *deadline = new QTimer(reply);
+    deadline->setSingleShot(true);
+    QObject::connect(deadline, SIGNAL(timeout()), reply, SLOT(abort()));
+    deadline->start(requestTimeout(function));
+    return reply;
+}
 
+int HangishClient::requestTimeout(const QString &function) const
+{
+    return mRequestTimeouts.value(function, REQUEST_TIMEOUT_MSECS);
 }
 
-void HangishClient::uploadPerformedReply()
+qint64 HangishClient::hedgeDelay(const QString &function) const
 {
-    QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
+    QList<qint64> samples = mLatencySamples.value(function);
+    if (samples.size() < HEDGE_MIN_SAMPLES) {
+        return -1;
+    }
+    std::sort(samples.begin(), samples.end());
+    int p95 = qCeil(samples.size() * 0.95) - 1;
+    return samples.at(p95);
+}
 
-    QVariant v = reply->header(QNetworkRequest::SetCookieHeader);
-    QList<QNetworkCookie> c = qvariant_cast<QList<QNetworkCookie> >(v);
-    qDebug() << "Got " << c.size() << "from" << reply->url();
-    Q_FOREACH (QNetworkCookie cookie, c) {
-        qDebug() << cookie.name();
+void HangishClient::hedgeRequest(QNetworkReply *reply, const QString &function, const QString &json, const char *member)
+{
+    if (!mHedgingEnabled) {
+        return;
     }
-    QString sreply = reply->readAll();
-    qDebug() << "Response " << sreply;
-    if (reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt()==200) {
-        qDebug() << "Upload in progress";
-        QJsonDocument doc = QJsonDocument::fromJson(sreply.toUtf8());
-        QJsonObject obj = doc.object().take("sessionStatus").toObject();
-        QString state = obj.take("state").toString();
-        qDebug() << state;
-        if (state=="FINALIZED") {
-            //Completed, send the message!
-
-            //Retrieve the id of the image
-            QString imgId = obj.take("additionalInfo").toObject()
-                            .take("uploader_service.GoogleRupioAdditionalInfo").toObject()
-                            .take("completionInfo").toObject()
-                            .take("customerSpecificInfo").toObject()
-                            .take("photoid").toString();
-            qDebug() << "Sending msg with img" << imgId;
-
-            sendImageMessage(mOutgoingImages.at(0).conversationId, imgId, "");
-            mOutgoingImages.clear();
-        }
-    } else {
-        qDebug() << "Problem uploading";
+    qint64 delay = hedgeDelay(function);
+    if (delay < 0) {
+        return;
     }
-    reply->deleteLater();
+
+    HedgedRequest hedgedRequest;
+    hedgedRequest.function = function;
+    hedgedRequest.json = json;
+    hedgedRequest.member = member;
+    mHedgeCandidates[reply] = hedgedRequest;
+
+    QTimer *hedgeTimer = new QTimer(reply);
+    hedgeTimer->setSingleShot(true);
+    QObject::connect(hedgeTimer, SIGNAL(timeout()), this, SLOT(onHedgeTimeout()));
+    hedgeTimer->start(delay);
 }
 
-QNetworkReply *HangishClient::sendRequest(const QString &function, const QString &json)
+void HangishClient::onHedgeTimeout()
 {
-    QUrl url(ENDPOINT_URL + function);
-    QUrlQuery query;
-    query.addQueryItem("alt", "protojson");
-    query.addQueryItem("key", mApiKey);
-    url.setQuery(query);
+    QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender()->parent());
+    if (!mHedgeCandidates.contains(reply) || !mPendingRequests.contains(reply)) {
+        return;
+    }
+    HedgedRequest hedgedRequest = mHedgeCandidates.take(reply);
+
+    qDebug() << "Hedging slow request" << hedgedRequest.function;
+    QNetworkReply *duplicate = sendRequest(hedgedRequest.function, hedgedRequest.json);
+    // whichever reply wins has to carry the same bookkeeping, but its
+    // latency sample starts when it was sent, not when the original was
+    Q_FOREACH (const QByteArray &name, reply->dynamicPropertyNames()) {
+        if (name != "hangishStartTime") {
+            duplicate->setProperty(name.constData(), reply->property(name.constData()));
+        }
+    }
+    QObject::connect(duplicate, SIGNAL(finished()), this, hedgedRequest.member.constData());
+    mPendingRequests[duplicate] = mPendingRequests[reply];
+    mHedgedReplies[reply] = duplicate;
+    mHedgedReplies[duplicate] = reply;
+}
 
-    QNetworkRequest req(url);
-    req.setRawHeader("authorization", getAuthHeader());
-    req.setRawHeader("x-origin", QByteArray(ORIGIN_URL));
-    req.setRawHeader("x-goog-authuser", "0");
-    req.setRawHeader("content-type", "application/json+protobuf");
+bool HangishClient::takePendingRequest(QNetworkReply *reply, quint64 &requestId)
+{
+    mHedgeCandidates.remove(reply);
+    bool succeeded = reply->error() == QNetworkReply::NoError &&
+                     reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() == 200;
+
+    QNetworkReply *sibling = mHedgedReplies.take(reply);
+    if (sibling) {
+        mHedgedReplies.remove(sibling);
+        if (!succeeded) {
+            // the other attempt is still running, let it answer instead
+            mPendingRequests.remove(reply);
+            return false;
+        }
+        mPendingRequests.remove(sibling);
+        QObject::disconnect(sibling, 0, this, 0);
+        sibling->abort();
+        sibling->deleteLater();
+    }
 
-    QList<QNetworkCookie> reqCookies;
-    Q_FOREACH (QNetworkCookie cookie, mSessionCookies) {
-        if (cookie.name()=="SAPISID" || cookie.name()=="SSID" || cookie.name()=="HSID" || cookie.name()=="APISID" || cookie.name()=="SID") {
-            reqCookies.append(cookie);
+    if (succeeded) {
+        QString function = reply->property("hangishFunction").toString();
+        QList<qint64> &samples = mLatencySamples[function];
+        samples.append(QDateTime::currentMSecsSinceEpoch() - reply->property("hangishStartTime").toLongLong());
+        if (samples.size() > LATENCY_SAMPLES) {
+            samples.removeFirst();
         }
     }
-    req.setHeader(QNetworkRequest::CookieHeader, QVariant::fromValue(reqCookies));
-    QByteArray postData;
-    postData.append(json);
-    return mNetworkAccessManager.post(req, postData);
+
+    requestId = mPendingRequests.take(reply);
+    return true;
+}
+
+QList<quint64> HangishClient::takeCoalescedRequests(QNetworkReply *reply, quint64 requestId)
+{
+    QString key = reply->property("hangishDedupKey").toString();
+    if (!key.isEmpty() && mInFlightRequests.value(key) == requestId) {
+        mInFlightRequests.remove(key);
+    }
+    return QList<quint64>() << requestId << mCoalescedRequests.take(requestId);
 }
 
 ClientRequestHeader *HangishClient::getRequestHeader1() const
@@ -260,7 +749,7 @@ QString HangishClient::getRequestHeader() const
     return res;
 }
 
-void HangishClient::sendImageMessage(const QString &convId, const QString &imgId, const QString &segments)
+void HangishClient::sendImageMessage(quint64 requestId, const QString &convId, const QString &imgId, const QString &segments)
 {
     QString seg = "[[0, \"";
     seg += segments;
@@ -290,6 +779,7 @@ void HangishClient::sendImageMessage(const QString &convId, const QString &imgId
     qDebug() << "gotH " << body;
     QNetworkReply *reply = sendRequest("conversations/sendchatmessage",body);
     QObject::connect(reply, SIGNAL(finished()), this, SLOT(sendMessageReply()));
+    mPendingRequests[reply] = requestId;
 }
 
 quint64 HangishClient::sendChatMessage(ClientSendChatMessageRequest clientSendChatMessageRequest)
@@ -307,7 +797,8 @@ void HangishClient::sendMessageReply()
 {
     QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
 
-    quint64 requestId = mPendingRequests.take(reply);
+    quint64 requestId = 0;
+    takePendingRequest(reply, requestId);
 
     QVariant v = reply->header(QNetworkRequest::SetCookieHeader);
     QList<QNetworkCookie> c = qvariant_cast<QList<QNetworkCookie> >(v);
@@ -315,8 +806,12 @@ void HangishClient::sendMessageReply()
     Q_FOREACH (QNetworkCookie cookie, c) {
         qDebug() << cookie.name();
     }
+    qint64 imageSentAt = mImagesSentAt.take(requestId);
     if (reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt()==200) {
         qDebug() << "Message sent correctly: " << requestId;
+        if (imageSentAt) {
+            Q_EMIT imageDelivered(requestId, QDateTime::currentMSecsSinceEpoch() - imageSentAt);
+        }
         Q_EMIT messageSent(requestId);
     } else {
         qDebug() << "Failed to send message: " << requestId;
@@ -325,177 +820,218 @@ void HangishClient::sendMessageReply()
     delete reply;
 }
 
-void HangishClient::sendImage(const QString &segments, const QString &conversationId, const QString &filename)
+quint64 HangishClient::sendImage(const QString &segments, const QString &conversationId, const QString &filename)
 {
     Q_UNUSED(segments)
-    QFile inFile(filename);
-    if (!inFile.open(QIODevice::ReadOnly)) {
+    if (!QFile::exists(filename)) {
         qDebug() << "File not found";
-        return ;
-    }
-
-    OutgoingImage oi;
-    oi.conversationId = conversationId;
-    oi.filename = filename;
-    mOutgoingImages.append(oi);
-
-    //First upload image to gdocs
-    QJsonObject emptyObj;
-    QJsonArray jarr;
-    QJsonObject j1, jj1;
-    j1["name"] = QJsonValue(QString("file"));
-    j1["filename"] = QJsonValue(QString(filename.right(filename.size()-filename.lastIndexOf("/")-1)));
-    j1["put"] = emptyObj;
-    j1["size"] =  QJsonValue(inFile.size());
-    jj1["external"] = j1;
-
-    QJsonObject j2, jj2;
-    j2["name"] = QJsonValue(QString("album_mode"));
-    j2["content"] = QJsonValue(QString("temporary"));
-    j2["contentType"] = QJsonValue(QString("text/plain"));
-    jj2["inlined"] = j2;
-
-    QJsonObject j3, jj3;
-    j3["name"] = QJsonValue(QString("title"));
-    j3["content"] = QJsonValue(QString(filename.right(filename.size()-filename.lastIndexOf("/")-1)));
-    j3["contentType"] = QJsonValue(QString("text/plain"));
-    jj3["inlined"] = j3;
-
-    qint64 time = QDateTime::currentMSecsSinceEpoch();
-    QJsonObject j4, jj4;
-    j4["name"] = QJsonValue(QString("addtime"));
-    j4["content"] = QJsonValue(QString::number(time));
-    j4["contentType"] = QJsonValue(QString("text/plain"));
-    jj4["inlined"] = j4;
-
-    QJsonObject j5, jj5;
-    j5["name"] = QJsonValue(QString("batchid"));
-    j5["content"] = QJsonValue(QString::number(time));
-    j5["contentType"] = QJsonValue(QString("text/plain"));
-    jj5["inlined"] = j5;
-
-    QJsonObject j6, jj6;
-    j6["name"] = QJsonValue(QString("album_name"));
-    j6["content"] = QJsonValue(QString("hangish"));
-    j6["contentType"] = QJsonValue(QString("text/plain"));
-    jj6["inlined"] = j6;
-
-    QJsonObject j7, jj7;
-    j7["name"] = QJsonValue(QString("album_abs_position"));
-    j7["content"] = QJsonValue(QString("0"));
-    j7["contentType"] = QJsonValue(QString("text/plain"));
-    jj7["inlined"] = j7;
-
-    QJsonObject j8, jj8;
-    j8["name"] = QJsonValue(QString("client"));
-    j8["content"] = QJsonValue(QString("hangouts"));
-    j8["contentType"] = QJsonValue(QString("text/plain"));
-    jj8["inlined"] = j8;
-
-    jarr.append(jj1);
-    jarr.append(jj2);
-    jarr.append(jj3);
-    jarr.append(jj4);
-    jarr.append(jj5);
-    jarr.append(jj6);
-    jarr.append(jj7);
-    jarr.append(jj8);
-
-    QJsonObject jjson;
-    jjson["fields"] = jarr;
-
-    QJsonObject json;
-    json["createSessionRequest"] = jjson;
-    json["protocolVersion"] = QJsonValue(QString("0.8"));
-
-
-    //url += "?alt=json&key=";
-    //url += mApiKey;
-    qDebug() << "Sending request for up image";
-    QJsonDocument doc(json);
-    qDebug() << doc.toJson();
-
-    QNetworkRequest req(QUrl("https://docs.google.com/upload/photos/resumable?authuser=0"));
-    //req.setRawHeader("authorization", getAuthHeader());
-    req.setRawHeader("User-Agent", USER_AGENT);
-    req.setRawHeader("X-GUploader-Client-Info", "mechanism=scotty xhr resumable; clientVersion=82480166");
-    req.setRawHeader("content-type", "application/x-www-form-urlencoded;charset=utf-8");
-    req.setRawHeader("Content-Length", QByteArray::number(doc.toJson().size()));
-
-    QList<QNetworkCookie> reqCookies;
-    Q_FOREACH (QNetworkCookie cookie, mSessionCookies) {
-        if (cookie.name()=="SAPISID" || cookie.name()=="SSID" || cookie.name()=="HSID" || cookie.name()=="APISID" || cookie.name()=="SID") {
-            reqCookies.append(cookie);
-        }
+        return 0;
     }
-    req.setHeader(QNetworkRequest::CookieHeader, QVariant::fromValue(reqCookies));
-    QNetworkReply * reply = mNetworkAccessManager.post(req, doc.toJson());
-    QObject::connect(reply, SIGNAL(finished()), this, SLOT(uploadImageReply()));
-    //Then send the message
+
+    //First upload image to gdocs, then send the message
+    quint64 requestId = mCurrentRequestId++;
+    mImagesSentAt[requestId] = QDateTime::currentMSecsSinceEpoch();
+    mImageUploader->upload(requestId, conversationId, filename);
+    return requestId;
 }
 
-void HangishClient::uploadImageReply()
+void HangishClient::onImageUploaded(quint64 requestId, const QString &conversationId, const QString &imageId)
 {
-    QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
-    qDebug() << "DbG: " << reply;
+    qDebug() << "Sending msg with img" << imageId;
+    sendImageMessage(requestId, conversationId, imageId, "");
+}
 
-    QVariant v = reply->header(QNetworkRequest::SetCookieHeader);
-    QList<QNetworkCookie> c = qvariant_cast<QList<QNetworkCookie> >(v);
-    qDebug() << "Got " << c.size() << "from" << reply->url();
-    Q_FOREACH (QNetworkCookie cookie, c) {
-        qDebug() << cookie.name();
-    }
-    QString sreply = reply->readAll();
-    qDebug() << "Response " << sreply;
-    if (reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt()==200) {
-        qDebug() << "Upload ready";
-        QVariant v = reply->header(QNetworkRequest::LocationHeader);
-        QString uploadUrl = qvariant_cast<QString>(v);
-        qDebug() << uploadUrl;
-        reply->close();
-        performImageUpload(uploadUrl);
-    } else {
-        qDebug() << "Problem uploading " << reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
-    }
-    reply->deleteLater();
+void HangishClient::onImageUploadFailed(quint64 requestId)
+{
+    mImagesSentAt.remove(requestId);
+    Q_EMIT messageNotSent(requestId);
 }
 
 quint64 HangishClient::queryPresence(const QStringList &chatIds)
 {
     quint64 requestId = mCurrentRequestId++;
-    ClientQueryPresenceRequest clientQueryPresenceRequest;
-    ClientParticipantList *participantList = new ClientParticipantList();
-    ClientFieldMaskList *fieldMaskList = new ClientFieldMaskList();
-    clientQueryPresenceRequest.set_allocated_requestheader(getRequestHeader1());
-    clientQueryPresenceRequest.set_allocated_participantlist(participantList);
-    clientQueryPresenceRequest.set_allocated_fieldmasklist(fieldMaskList);
+    PresenceWaiter waiter;
+    waiter.requestId = requestId;
     Q_FOREACH(const QString &chatId, chatIds) {
-        ClientParticipantId *participantId = participantList->add_participantid();
-        participantId->set_gaiaid(chatId.toLocal8Bit().data());
+        waiter.ids.insert(IdTable::intern(chatId));
+    }
+    mPresenceWaiters.append(waiter);
+    // overlapping queries arriving within the window share one request
+    if (!mPresenceBatchTimer.isActive()) {
+        mPresenceBatchTimer.start(PRESENCE_BATCH_WINDOW_MSECS);
     }
-    fieldMaskList->add_fieldmask(ClientQueryPresenceRequest_ClientFieldMask_AVAILABILITY);
-    fieldMaskList-> add_fieldmask(ClientQueryPresenceRequest_ClientFieldMask_STATUS_MESSAGE);
-    QNetworkReply *reply = sendRequest("presence/querypresence", Utils::msgToJsArray(clientQueryPresenceRequest));
-    mPendingRequests[reply] = requestId;
-    QObject::connect(reply, SIGNAL(finished()), this, SLOT(queryPresenceReply()));
     return requestId;
 }
 
+void HangishClient::flushPresenceQueries()
+{
+    if (mPresenceWaiters.isEmpty()) {
+        return;
+    }
+
+    // only ask for what is missing from the table or too old
+    QSet<IdHandle> queued;
+    Q_FOREACH(const PresenceWaiter &waiter, mPresenceWaiters) {
+        Q_FOREACH(IdHandle id, waiter.ids) {
+            if (!isPresenceFresh(id)) {
+                queued.insert(id);
+            }
+        }
+    }
+    if (queued.isEmpty()) {
+        QList<PresenceWaiter> waiters = mPresenceWaiters;
+        mPresenceWaiters.clear();
+        answerPresenceWaiters(waiters, ClientQueryPresenceResponse());
+        return;
+    }
+
+    quint64 batchId = mCurrentRequestId++;
+    ClientQueryPresenceRequest clientQueryPresenceRequest;
+    ClientParticipantList *participantList = new ClientParticipantList();
+    ClientFieldMaskList *fieldMaskList = new ClientFieldMaskList();
+    clientQueryPresenceRequest.set_allocated_requestheader(getRequestHeader1());
+    clientQueryPresenceRequest.set_allocated_participantlist(participantList);
+    clientQueryPresenceRequest.set_allocated_fieldmasklist(fieldMaskList);
+    Q_FOREACH(IdHandle id, queued) {
+        ClientParticipantId *participantId = participantList->add_participantid();
+        participantId->set_gaiaid(IdTable::toStdString(id));
+    }
+    fieldMaskList->add_fieldmask(ClientQueryPresenceRequest_ClientFieldMask_AVAILABILITY);
+    fieldMaskList-> add_fieldmask(ClientQueryPresenceRequest_ClientFieldMask_STATUS_MESSAGE);
+    QString json = Utils::msgToJsArray(clientQueryPresenceRequest);
+    QNetworkReply *reply = sendRequest("presence/querypresence", json);
+    mPendingRequests[reply] = batchId;
+    mPresenceBatches[batchId] = mPresenceWaiters;
+    mPresenceWaiters.clear();
+    QObject::connect(reply, SIGNAL(finished()), this, SLOT(queryPresenceReply()));
+    hedgeRequest(reply, "presence/querypresence", json, SLOT(queryPresenceReply()));
+}
+
 void HangishClient::queryPresenceReply()
 {
     QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
+    quint64 batchId = 0;
+    if (!takePendingRequest(reply, batchId)) {
+        reply->deleteLater();
+        return;
+    }
+    QList<PresenceWaiter> waiters = mPresenceBatches.take(batchId);
     QString sreply = reply->readAll();
     ClientQueryPresenceResponse cqprp;
     if (reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt()!=200) {
         qDebug() << "There was an error getting presence! " << reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        Q_FOREACH(const PresenceWaiter &waiter, waiters) {
+            Q_EMIT requestFailed(waiter.requestId);
+        }
+        reply->deleteLater();
         return;
     }
     QVariantList variantListResponse = Utils::jsArrayToVariantList(sreply);
-    if (variantListResponse[0].toString() == "cqprp") {
-        variantListResponse.pop_front();
-        Utils::packToMessage(QVariantList() << variantListResponse, cqprp);
-        Q_EMIT clientQueryPresenceResponse(mPendingRequests.take(reply), cqprp);
+    if (variantListResponse.isEmpty() || variantListResponse[0].toString() != "cqprp") {
+        Q_FOREACH(const PresenceWaiter &waiter, waiters) {
+            Q_EMIT requestFailed(waiter.requestId);
+        }
+        reply->deleteLater();
+        return;
+    }
+    variantListResponse.pop_front();
+    Utils::packToMessage(QVariantList() << variantListResponse, cqprp);
+
+    for (int i = 0; i < cqprp.presenceresult_size(); i++) {
+        const ClientPresenceResult &result = cqprp.presenceresult(i);
+        if (result.has_presence()) {
+            updatePresence(result.userid(), result.presence());
+        }
+    }
+    // remember what the server had nothing for, so it is not asked again right away
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    Q_FOREACH(const PresenceWaiter &waiter, waiters) {
+        Q_FOREACH(IdHandle id, waiter.ids) {
+            if (id && !isPresenceFresh(id)) {
+                PresenceEntry &entry = mPresence[id];
+                entry.known = false;
+                entry.updatedAt = now;
+            }
+        }
+    }
+    answerPresenceWaiters(waiters, cqprp);
+    reply->deleteLater();
+}
+
+void HangishClient::answerPresenceWaiters(const QList<PresenceWaiter> &waiters, const ClientQueryPresenceResponse &cqprp)
+{
+    // hand each caller only the results it asked for
+    QVector<IdHandle> gaiaIds(cqprp.presenceresult_size());
+    QVector<IdHandle> chatIds(cqprp.presenceresult_size());
+    for (int i = 0; i < cqprp.presenceresult_size(); i++) {
+        gaiaIds[i] = IdTable::find(cqprp.presenceresult(i).userid().gaiaid());
+        chatIds[i] = IdTable::find(cqprp.presenceresult(i).userid().chatid());
+    }
+    Q_FOREACH(const PresenceWaiter &waiter, waiters) {
+        ClientQueryPresenceResponse waiterResponse;
+        if (cqprp.has_responseheader()) {
+            waiterResponse.mutable_responseheader()->CopyFrom(cqprp.responseheader());
+        }
+        QSet<IdHandle> answered;
+        for (int i = 0; i < cqprp.presenceresult_size(); i++) {
+            if ((gaiaIds[i] && waiter.ids.contains(gaiaIds[i])) ||
+                (chatIds[i] && waiter.ids.contains(chatIds[i]))) {
+                waiterResponse.add_presenceresult()->CopyFrom(cqprp.presenceresult(i));
+                answered << gaiaIds[i] << chatIds[i];
+            }
+        }
+        // the rest comes from the table
+        Q_FOREACH(IdHandle id, waiter.ids) {
+            if (!answered.contains(id) && isPresenceFresh(id) && mPresence.value(id).known) {
+                const PresenceEntry &entry = mPresence[id];
+                ClientPresenceResult *result = waiterResponse.add_presenceresult();
+                result->mutable_userid()->CopyFrom(entry.userId);
+                result->mutable_presence()->CopyFrom(entry.presence);
+            }
+        }
+        Q_EMIT clientQueryPresenceResponse(waiter.requestId, waiterResponse);
+    }
+}
+
+bool HangishClient::isPresenceFresh(IdHandle id) const
+{
+    QHash<IdHandle, PresenceEntry>::const_iterator it = mPresence.constFind(id);
+    return it != mPresence.constEnd() &&
+           QDateTime::currentMSecsSinceEpoch() - it->updatedAt < PRESENCE_TTL_SECS * 1000;
+}
+
+void HangishClient::updatePresence(const ClientParticipantId &userId, const ClientPresence &presence)
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QList<IdHandle> ids;
+    ids << IdTable::intern(userId.gaiaid()) << IdTable::intern(userId.chatid());
+    bool changed = false;
+    Q_FOREACH(IdHandle id, ids) {
+        if (!id) {
+            continue;
+        }
+        PresenceEntry &entry = mPresence[id];
+        if (!entry.known || entry.presence.SerializePartialAsString() != presence.SerializePartialAsString()) {
+            changed = true;
+        }
+        entry.userId.CopyFrom(userId);
+        entry.presence.CopyFrom(presence);
+        entry.updatedAt = now;
+        entry.known = true;
+    }
+    if (changed) {
+        Q_EMIT presenceChanged(userId.has_chatid() ? userId.chatid().c_str() : userId.gaiaid().c_str());
+    }
+}
+
+bool HangishClient::getPresence(const QString &chatId, ClientPresence &presence) const
+{
+    IdHandle id = IdTable::find(chatId);
+    if (!isPresenceFresh(id) || !mPresence.value(id).known) {
+        return false;
     }
+    presence = mPresence.value(id).presence;
+    return true;
 }
 
 quint64 HangishClient::setPresence(bool goingOnline)
@@ -517,31 +1053,47 @@ quint64 HangishClient::setPresence(bool goingOnline)
 void HangishClient::setPresenceReply()
 {
     QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
+    quint64 requestId = 0;
+    takePendingRequest(reply, requestId);
     QString sreply = reply->readAll();
     qDebug() << "Set presence response " << sreply;
     if (reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt()!=200) {
         qDebug() << "There was an error setting presence! " << reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        Q_EMIT requestFailed(requestId);
+        reply->deleteLater();
+        return;
     }
     ClientSetPresenceResponse csprp;
     QVariantList variantListResponse = Utils::jsArrayToVariantList(sreply);
-    if (variantListResponse[0].toString() == "csprp") {
+    if (!variantListResponse.isEmpty() && variantListResponse[0].toString() == "csprp") {
         variantListResponse.pop_front();
         Utils::packToMessage(QVariantList() << variantListResponse, csprp);
-        Q_EMIT clientSetPresenceResponse(mPendingRequests.take(reply), csprp);
+        Q_EMIT clientSetPresenceResponse(requestId, csprp);
     }
+    reply->deleteLater();
 }
 
 void HangishClient::setFocus(const QString &convId, int status)
 {
-    QString body = "[";
-    body += getRequestHeader();
-    body += ", [\"";
-    body += convId;
-    body += "\"], ";
-    body += QString::number(status);
-    body += ", 20]";
-    qDebug() << body;
-    QNetworkReply *reply = sendRequest("conversations/setfocus",body);
+    ConversationActivity &activity = mConversationActivity[IdTable::intern(convId)];
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    if (activity.focusStatus == status && now - activity.focusSentAt < FOCUS_REFRESH_SECS * 1000) {
+        mActivityCounters.suppressedFocus++;
+        return;
+    }
+    if (!ClientFocusType_IsValid(status)) {
+        qDebug() << "Invalid focus type" << status;
+        return;
+    }
+    activity.focusStatus = status;
+    activity.focusSentAt = now;
+
+    ClientSetFocusRequest clientSetFocusRequest;
+    clientSetFocusRequest.set_allocated_requestheader(getRequestHeader1());
+    clientSetFocusRequest.mutable_conversationid()->set_id(convId.toStdString());
+    clientSetFocusRequest.set_type(static_cast<ClientFocusType>(status));
+    clientSetFocusRequest.set_timeoutsecs(FOCUS_TIMEOUT_SECS);
+    QNetworkReply *reply = sendRequest("conversations/setfocus", Utils::msgToJsArray(clientSetFocusRequest));
     QObject::connect(reply, SIGNAL(finished()), this, SLOT(setFocusReply()));
 }
 
@@ -553,21 +1105,29 @@ void HangishClient::setFocusReply()
     if (reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt()!=200) {
         qDebug() << "There was an error setting focus! " << reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
     }
+    reply->deleteLater();
 }
 
 void HangishClient::setTyping(const QString &convId, int status)
 {
-    ClientSetTypingRequest request;
-    //ClientConversationId conversationId = new ClientConversationId();
-    QString body = "[";
-    body += getRequestHeader();
-    body += ", [\"";
-    body += convId;
-    body += "\"], ";
-    body += QString::number(status);
-    body += "]";
-    qDebug() << body;
-    QNetworkReply *reply = sendRequest("conversations/settyping",body);
+    ConversationActivity &activity = mConversationActivity[IdTable::intern(convId)];
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    if (activity.typingStatus == status && now - activity.typingSentAt < TYPING_REFRESH_SECS * 1000) {
+        mActivityCounters.suppressedTyping++;
+        return;
+    }
+    if (!ClientTypingType_IsValid(status)) {
+        qDebug() << "Invalid typing type" << status;
+        return;
+    }
+    activity.typingStatus = status;
+    activity.typingSentAt = now;
+
+    ClientSetTypingRequest clientSetTypingRequest;
+    clientSetTypingRequest.set_allocated_requestheader(getRequestHeader1());
+    clientSetTypingRequest.mutable_conversationid()->set_id(convId.toStdString());
+    clientSetTypingRequest.set_type(static_cast<ClientTypingType>(status));
+    QNetworkReply *reply = sendRequest("conversations/settyping", Utils::msgToJsArray(clientSetTypingRequest));
     QObject::connect(reply, SIGNAL(finished()), this, SLOT(setTypingReply()));
 }
 
@@ -579,21 +1139,41 @@ void HangishClient::setTypingReply()
     if (reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt()!=200) {
         qDebug() << "There was an error setting typing status! " << reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
     }
+    reply->deleteLater();
 }
 
 quint64 HangishClient::getConversation(ClientGetConversationRequest clientGetConversationRequest)
 {
     quint64 requestId = mCurrentRequestId++;
+
+    // identical requests already in flight share the same reply
+    clientGetConversationRequest.clear_requestheader();
+    QString key = "conversations/getconversation" + Utils::msgToJsArray(clientGetConversationRequest);
+    if (mInFlightRequests.contains(key)) {
+        mCoalescedRequests[mInFlightRequests[key]].append(requestId);
+        return requestId;
+    }
+
     clientGetConversationRequest.set_allocated_requestheader(getRequestHeader1());
-    QNetworkReply *reply = sendRequest("conversations/getconversation", Utils::msgToJsArray(clientGetConversationRequest));
+    QString json = Utils::msgToJsArray(clientGetConversationRequest);
+    QNetworkReply *reply = sendRequest("conversations/getconversation", json);
     QObject::connect(reply, SIGNAL(finished()), this, SLOT(getConversationReply()));
+    reply->setProperty("hangishDedupKey", key);
     mPendingRequests[reply] = requestId;
+    mInFlightRequests[key] = requestId;
+    hedgeRequest(reply, "conversations/getconversation", json, SLOT(getConversationReply()));
     return requestId;
 }
 
 void HangishClient::getConversationReply()
 {
     QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
+    quint64 requestId = 0;
+    if (!takePendingRequest(reply, requestId)) {
+        reply->deleteLater();
+        return;
+    }
+    QList<quint64> requestIds = takeCoalescedRequests(reply, requestId);
 
     QVariant v = reply->header(QNetworkRequest::SetCookieHeader);
     QList<QNetworkCookie> c = qvariant_cast<QList<QNetworkCookie> >(v);
@@ -607,24 +1187,69 @@ void HangishClient::getConversationReply()
 
         ClientGetConversationResponse cgcr;
         QVariantList variantListResponse = Utils::jsArrayToVariantList(sreply);
-        if (variantListResponse[0].toString() == "cgcrp") {
+        if (!variantListResponse.isEmpty() && variantListResponse[0].toString() == "cgcrp") {
             variantListResponse.pop_front();
             Utils::packToMessage(QVariantList() << variantListResponse, cgcr);
-            Q_EMIT clientGetConversationResponse(mPendingRequests.take(reply), cgcr);
+            deliverEvents(cgcr.conversationstate());
+            mergeConversationState(cgcr.conversationstate());
+            Q_FOREACH(quint64 id, requestIds) {
+                Q_EMIT clientGetConversationResponse(id, cgcr);
+            }
+        } else {
+            Q_FOREACH(quint64 id, requestIds) {
+                Q_EMIT requestFailed(id);
+            }
+        }
+    } else {
+        qDebug() << "There was an error getting the conversation! " << reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        Q_FOREACH(quint64 id, requestIds) {
+            Q_EMIT requestFailed(id);
         }
     }
     reply->deleteLater();
 }
 
 void HangishClient::syncAllNewEvents(quint64 timestamp)
+{
+    requestSyncPage(timestamp, 0);
+}
+
+void HangishClient::requestSyncPage(quint64 timestamp, int page)
 {
     ClientSyncAllNewEventsRequest clientSyncAllNewEventsRequest;
     clientSyncAllNewEventsRequest.set_allocated_requestheader(getRequestHeader1());
     clientSyncAllNewEventsRequest.set_lastsynctimestamp(timestamp);
     clientSyncAllNewEventsRequest.set_nomissedeventsexpected(false);
-    clientSyncAllNewEventsRequest.set_maxresponsesizebytes(1048576);
+    clientSyncAllNewEventsRequest.set_maxresponsesizebytes(SYNC_PAGE_SIZE_BYTES);
+    Q_FOREACH (ClientSyncFilter filter, mSyncFilters) {
+        clientSyncAllNewEventsRequest.add_syncfilter(filter);
+    }
+
+    // tell the server what we already have for the busiest conversations
+    Q_FOREACH (IdHandle convId, mConversations.mostRecent(SYNC_LOCAL_STATES)) {
+        ConversationStatePtr state = mConversations.peek(convId);
+        if (state->event_size()) {
+            ClientLocalConversationState *localState = clientSyncAllNewEventsRequest.add_localstate();
+            localState->mutable_conversationid()->CopyFrom(state->conversationid());
+            for (int i = qMax(0, state->event_size() - SYNC_RECENT_EVENT_IDS); i < state->event_size(); i++) {
+                if (!state->event(i).eventid().empty()) {
+                    localState->add_recenteventid(state->event(i).eventid());
+                }
+            }
+        }
+        const ClientUserConversationState &selfState = state->conversation().selfconversationstate();
+        if (selfState.has_selfreadstate()) {
+            ClientUnreadConversationState *unreadState = clientSyncAllNewEventsRequest.add_unreadstate();
+            unreadState->mutable_conversationid()->CopyFrom(state->conversationid());
+            unreadState->set_latestreadtimestamp(selfState.selfreadstate().latestreadtimestamp());
+        }
+    }
 
     QNetworkReply *reply = sendRequest("conversations/syncallnewevents", Utils::msgToJsArray(clientSyncAllNewEventsRequest));
+    // every page of one sync asks from the same point, the server has no cursor
+    reply->setProperty("hangishSyncTimestamp", timestamp);
+    reply->setProperty("hangishSyncPage", page);
+    QObject::connect(reply, SIGNAL(readyRead()), this, SLOT(onSyncReadyRead()));
     QObject::connect(reply, SIGNAL(finished()), this, SLOT(syncAllNewEventsReply()));
 }
 
@@ -639,23 +1264,114 @@ void HangishClient::syncAllNewEventsReply()
     Q_FOREACH (QNetworkCookie cookie, c) {
         qDebug() << cookie.name();
     }
-    QString sreply = reply->readAll();
+    // whatever is left after the last readyRead
+    decodeSyncStream(reply);
+    SyncStreamDecoder *decoder = mSyncDecoders.take(reply);
+    QList<ClientConversationState> deferred = mSyncDeferredStates.take(reply);
+    int states = mSyncStateCounts.take(reply);
 
     if (reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt()==200) {
-        qDebug() << "Synced correctly";
+        qDebug() << "Synced correctly," << states << "conversations";
 
+        // the states were emitted while streaming, this is everything else
         ClientSyncAllNewEventsResponse csanerp;
-        QVariantList variantListResponse = Utils::jsArrayToVariantList(sreply);
-        if (variantListResponse[0].toString() == "csanerp") {
+        QVariantList variantListResponse = Utils::jsArrayToVariantList(decoder ? QString::fromUtf8(decoder->skeleton()) : QString());
+        if (!variantListResponse.isEmpty() && variantListResponse[0].toString() == "csanerp") {
             variantListResponse.pop_front();
             Utils::packToMessage(QVariantList() << variantListResponse, csanerp);
+            if (csanerp.synctimestamp() > mLastSyncTimestamp) {
+                mLastSyncTimestamp = csanerp.synctimestamp();
+            }
+
+            int queued = 0;
+            if (csanerp.conversationidsonly()) {
+                // too much happened, fetch each conversation on its own
+                Q_FOREACH (const ClientConversationState &state, deferred) {
+                    IdHandle convId = IdTable::intern(state.conversationid().id());
+                    if (convId && queueCatchUp(convId)) {
+                        queued++;
+                    }
+                }
+                startCatchUps();
+            } else {
+                // not an ids only response, these were ordinary states
+                for (int i = 0; i < deferred.size(); i++) {
+                    applySyncedState(reply, deferred[i]);
+                }
+            }
+            Q_FOREACH (const ClientConversationState &state, mSyncStates.take(reply)) {
+                csanerp.add_conversationstate()->CopyFrom(state);
+            }
             Q_EMIT clientSyncAllNewEventsResponse(csanerp);
+
+            int page = reply->property("hangishSyncPage").toInt() + 1;
+            if (queued > 0 && page < SYNC_MAX_PAGES) {
+                // truncated, ask again until no conversation is left to catch up
+                delete decoder;
+                mSyncStates.remove(reply);
+                requestSyncPage(reply->property("hangishSyncTimestamp").toULongLong(), page);
+                reply->deleteLater();
+                return;
+            }
         }
         mNeedSync = false;
+    } else if (mUsingCachedInit && reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() >= 400 &&
+               reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() < 500) {
+        qDebug() << "Sync rejected" << reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        delete decoder;
+        mSyncStates.remove(reply);
+        reply->deleteLater();
+        discardInitCache();
+        return;
     }
+    delete decoder;
+    mSyncStates.remove(reply);
+    finishPhase(BOOTSTRAP_SYNC);
     reply->deleteLater();
 }
 
+void HangishClient::onSyncReadyRead()
+{
+    decodeSyncStream(qobject_cast<QNetworkReply *>(sender()));
+}
+
+void HangishClient::decodeSyncStream(QNetworkReply *reply)
+{
+    if (reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt()!=200) {
+        return;
+    }
+    if (!mSyncDecoders.contains(reply)) {
+        mSyncDecoders[reply] = new SyncStreamDecoder();
+    }
+    Q_FOREACH (const QByteArray &text, mSyncDecoders[reply]->feed(reply->readAll())) {
+        ClientConversationState state;
+        // one engine for every state instead of one per state
+        Utils::packToMessage(Utils::jsArrayToVariantList(mSyncScriptEngine, QString::fromUtf8(text)), state);
+        mSyncStateCounts[reply]++;
+        if (!state.has_conversation() && state.event_size() == 0) {
+            // may be an id only, conversationIdsOnly comes after the states
+            mSyncDeferredStates[reply].append(state);
+            continue;
+        }
+        applySyncedState(reply, state);
+    }
+}
+
+void HangishClient::applySyncedState(QNetworkReply *reply, ClientConversationState &state)
+{
+    deliverEvents(state);
+    mergeConversationState(state);
+    if (mSyncResponseStates) {
+        mSyncStates[reply].append(state);
+    }
+    Q_EMIT conversationStateSynced(state);
+}
+
+void HangishClient::setSyncResponseStates(bool enabled)
+{
+    mSyncResponseStates = enabled;
+}
+
 void HangishClient::setActiveClient()
 {
     QDateTime now = QDateTime::currentDateTime();
@@ -690,22 +1406,43 @@ void HangishClient::setActiveClientReply()
     }
 }
 
-void HangishClient::updateWatermark(QString convId)
+void HangishClient::updateWatermark(QString convId, quint64 latestReadTimestamp)
 {
-    qDebug() << "Updating wm";
-    //If there are no unread messages we can avoid generating data traffic
-    //if (!rosterModel->hasUnreadMessages(convId))
-    //    return;
-    QString body = "[";
-    body += getRequestHeader();
-    body += ", [";
-    body += convId;
-    body += "], ";
-    body += QString::number(QDateTime::currentDateTime().toMSecsSinceEpoch()*1000);
-    body += "]";
-    qDebug() << body;
-    QNetworkReply *reply = sendRequest("conversations/updatewatermark",body);
-    QObject::connect(reply, SIGNAL(finished()), this, SLOT(updateWatermarkReply()));
+    if (latestReadTimestamp == 0) {
+        latestReadTimestamp = QDateTime::currentDateTime().toMSecsSinceEpoch()*1000;
+    }
+    // only the latest timestamp of each window is sent
+    IdHandle conversation = IdTable::intern(convId);
+    if (mPendingWatermarks.contains(conversation)) {
+        mActivityCounters.suppressedWatermarks++;
+    }
+    mPendingWatermarks[conversation] = qMax(mPendingWatermarks.value(conversation), latestReadTimestamp);
+    markConversationRead(conversation, latestReadTimestamp);
+    if (!mWatermarkTimer.isActive()) {
+        mWatermarkTimer.start(WATERMARK_WINDOW_MSECS);
+    }
+}
+
+void HangishClient::flushWatermarks()
+{
+    QHash<IdHandle, quint64>::const_iterator it;
+    for (it = mPendingWatermarks.constBegin(); it != mPendingWatermarks.constEnd(); ++it) {
+        ConversationActivity &activity = mConversationActivity[it.key()];
+        if (it.value() <= activity.watermark) {
+            mActivityCounters.suppressedWatermarks++;
+            continue;
+        }
+        activity.watermark = it.value();
+
+        qDebug() << "Updating wm" << IdTable::toString(it.key());
+        ClientUpdateWatermarkRequest clientUpdateWatermarkRequest;
+        clientUpdateWatermarkRequest.set_allocated_requestheader(getRequestHeader1());
+        clientUpdateWatermarkRequest.mutable_conversationid()->set_id(IdTable::toStdString(it.key()));
+        clientUpdateWatermarkRequest.set_latestreadtimestamp(it.value());
+        QNetworkReply *reply = sendRequest("conversations/updatewatermark", Utils::msgToJsArray(clientUpdateWatermarkRequest));
+        QObject::connect(reply, SIGNAL(finished()), this, SLOT(updateWatermarkReply()));
+    }
+    mPendingWatermarks.clear();
 }
 
 void HangishClient::updateWatermarkReply()
@@ -717,6 +1454,7 @@ void HangishClient::updateWatermarkReply()
     if (reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt()!=200) {
         qDebug() << "There was an error updating the wm! " << reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
     }
+    reply->deleteLater();
 }
 
 void HangishClient::initChat(const QString &pvt)
@@ -768,19 +1506,30 @@ void HangishClient::onInitChatReply()
             followRedirection(possibleRedirectUrl.toUrl());
             reply->deleteLater();
         } else {
-            QString sreply = reply->readAll();
-
-            QRegExp rx("(\\[\\[\"cin:cac\".*\\}\\}\\)\\;)");
-            if (rx.indexIn(sreply) != -1) {
-                QString cincac = rx.cap(1).split("}});")[0];
-                QVariantList list = Utils::jsArrayToVariantList(cincac)[0].toList();
-                if (list[0] =="cin:cac") {
+            QByteArray page = reply->readAll();
+
+            // find all the init data blocks in one pass over the page
+            QSet<QByteArray> names;
+            names << "cin:cac" << "cin:bcsc" << "cin:acc" << "cgsirp" << "cgserp" << "csrcrp";
+            QHash<QByteArray, QVariantList> initData;
+            Q_FOREACH (const InitDataBlock &block, Utils::scanInitDataBlocks(page, names)) {
+                // cin:acc shows up more than once, we want the one from ds:2 onwards
+                if (initData.contains(block.name) ||
+                    (block.name == "cin:acc" && (!block.key.startsWith("ds:") || block.key.mid(3).toInt() < 2))) {
+                    continue;
+                }
+                QVariantList list = Utils::jsArrayToVariantList(QString::fromUtf8(block.data)).value(0).toList();
+                if (!list.isEmpty() && list[0].toByteArray() == block.name) {
                     list.removeAt(0);
-                    ChatApiConfiguration chatApiConfiguration;
-                    Utils::packToMessage(list, chatApiConfiguration);
-                    mApiKey = chatApiConfiguration.key().c_str();
+                    initData[block.name] = list;
                 }
             }
+
+            if (initData.contains("cin:cac")) {
+                ChatApiConfiguration chatApiConfiguration;
+                Utils::packToMessage(initData["cin:cac"], chatApiConfiguration);
+                mApiKey = chatApiConfiguration.key().c_str();
+            }
             if (mApiKey.isEmpty()) {
                 qDebug() << reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
                 qDebug() << "Auth expired!";
@@ -788,37 +1537,20 @@ void HangishClient::onInitChatReply()
                 deleteCookies();
             }
 
-            rx.setPattern("(\\[\\[\"cin:bcsc\".*\\}\\}\\)\\;)");
-            if (rx.indexIn(sreply) != -1) {
-                QString cinbcsc = rx.cap(1).split("}});")[0];
-                QVariantList list = Utils::jsArrayToVariantList(cinbcsc)[0].toList();
-                if (list[0] =="cin:bcsc") {
-                    list.removeAt(0);
-                    EcConfiguration ecConfiguration;
-                    Utils::packToMessage(list, ecConfiguration);
-                    mChannelPath = ecConfiguration.channelpath().c_str();
-                    mChannelEcParam = ecConfiguration.ecparam().c_str();
-                    mChannelPropParam = ecConfiguration.propparam().c_str();
-                    mHeaderId = ecConfiguration.headerid().c_str();
-                }
+            if (initData.contains("cin:bcsc")) {
+                EcConfiguration ecConfiguration;
+                Utils::packToMessage(initData["cin:bcsc"], ecConfiguration);
+                mChannelPath = ecConfiguration.channelpath().c_str();
+                mChannelEcParam = ecConfiguration.ecparam().c_str();
+                mChannelPropParam = ecConfiguration.propparam().c_str();
+                mHeaderId = ecConfiguration.headerid().c_str();
             }
 
-            QString cinaccReply;
-            int cinaccReplyPos = 0;
-            if ((cinaccReplyPos = sreply.indexOf("key: 'ds:2'")) != -1) {
-                cinaccReply = sreply.mid(cinaccReplyPos);
-            }
-            rx.setPattern("(\\[\\[\"cin:acc\".*\\}\\}\\)\\;)");
-            if (rx.indexIn(cinaccReply) != -1) {
-                QString cinacc = rx.cap(1).split("}});")[0];
-                QVariantList list = Utils::jsArrayToVariantList(cinacc)[0].toList();
-                if (list[0] =="cin:acc") {
-                    list.removeAt(0);
-                    ChatInitParameters chatInitParameters;
-                    Utils::packToMessage(list, chatInitParameters);
-                    mHeaderDate = chatInitParameters.headerdate().c_str();
-                    mHeaderVersion = chatInitParameters.headerversion().c_str();
-                }
+            if (initData.contains("cin:acc")) {
+                ChatInitParameters chatInitParameters;
+                Utils::packToMessage(initData["cin:acc"], chatInitParameters);
+                mHeaderDate = chatInitParameters.headerdate().c_str();
+                mHeaderVersion = chatInitParameters.headerversion().c_str();
             }
 
             qDebug() << "HID " << mHeaderId;
@@ -826,56 +1558,19 @@ void HangishClient::onInitChatReply()
             qDebug() << "HVE " << mHeaderVersion;
 
             // Parse myself
-            rx.setPattern("(\\[\\[\"cgsirp\".*\\}\\}\\)\\;)");
-            if (rx.indexIn(sreply) != -1) {
-                QString cgsirp = rx.cap(1).split("}});")[0];
-                QVariantList list = Utils::jsArrayToVariantList(cgsirp)[0].toList();
-                if (list[0] =="cgsirp") {
-                    list.removeAt(0);
-                    ClientGetSelfInfoResponse clientGetSelfInfoResponse;
-                    Utils::packToMessage(list, clientGetSelfInfoResponse);
-                    mMyself = clientGetSelfInfoResponse.selfentity();
-                }
-            }
-
-            // Parse Users
-            rx.setPattern("(\\[\\[\"cgserp\".*\\}\\}\\)\\;)");
-            if (rx.indexIn(sreply) != -1) {
-                QString cgserp = rx.cap(1).split("}});")[0];
-                QVariantList list = Utils::jsArrayToVariantList(cgserp)[0].toList();
-                if (list[0] =="cgserp") {
-                    list.removeAt(0);
-                    ClientGetSuggestedEntitiesResponse clientGetSuggestedEntitiesResponse;
-                    Utils::packToMessage(list, clientGetSuggestedEntitiesResponse);
-                    if (clientGetSuggestedEntitiesResponse.has_hangoutcontacts()) {
-                        ClientContactGroup contactGroup = clientGetSuggestedEntitiesResponse.hangoutcontacts();
-                        for (int i =0; i < contactGroup.contactentity_size(); i++) {
-                            ClientContactEntity contactEntity = contactGroup.contactentity(i);
-                            ClientEntity entity = contactEntity.entity();
-                            mUsers[QString(entity.id().chatid().c_str())] = entity;
-                        }
-                    }
-                }
+            if (initData.contains("cgsirp")) {
+                ClientGetSelfInfoResponse clientGetSelfInfoResponse;
+                Utils::packToMessage(initData["cgsirp"], clientGetSelfInfoResponse);
+                mMyself = clientGetSelfInfoResponse.selfentity();
             }
 
-            //Parse conversations
-            rx.setPattern("(\\[\\[\"csrcrp\".*\\}\\}\\)\\;)");
-            if (rx.indexIn(sreply) != -1) {
-                QString csrcrp = rx.cap(1).split("}});")[0];
-                QVariantList list = Utils::jsArrayToVariantList(csrcrp)[0].toList();
-                if (list[0] =="csrcrp") {
-                    list.removeAt(0);
-                    ClientSyncRecentConversationsResponse clientSyncRecentConversationsResponse;
-                    Utils::packToMessage(list, clientSyncRecentConversationsResponse);
-                    for (int i=0; i < clientSyncRecentConversationsResponse.conversationstate_size(); i++) {
-                        ClientConversationState conv = clientSyncRecentConversationsResponse.conversationstate(i);
-                        mConversations[QString(conv.conversationid().id().c_str())] = conv;
-                    }
-                }
-
-            }
             reply->deleteLater();
-            initDone();
+            if (!mApiKey.isEmpty()) {
+                saveInitCache();
+            }
+            // users and conversations are decoded once sync and channel are on their way
+            mInitData = initData;
+            finishPhase(BOOTSTRAP_INIT_PAGE);
         }
     } else {
         //failure
@@ -884,11 +1579,127 @@ void HangishClient::onInitChatReply()
     }
 }
 
+void HangishClient::decodeInitData()
+{
+    // Parse Users
+    if (mInitData.contains("cgserp")) {
+        ClientGetSuggestedEntitiesResponse clientGetSuggestedEntitiesResponse;
+        Utils::packToMessage(mInitData["cgserp"], clientGetSuggestedEntitiesResponse);
+        if (clientGetSuggestedEntitiesResponse.has_hangoutcontacts()) {
+            ClientContactGroup contactGroup = clientGetSuggestedEntitiesResponse.hangoutcontacts();
+            for (int i =0; i < contactGroup.contactentity_size(); i++) {
+                ClientContactEntity contactEntity = contactGroup.contactentity(i);
+                const ClientEntity &entity = contactEntity.entity();
+                IdHandle id = IdTable::intern(entity.id().chatid());
+                mUsers[id] = ClientEntityPtr(new ClientEntity(entity));
+                mCompletions.setUser(id, entity);
+            }
+        }
+    }
+
+    //Parse conversations
+    if (mInitData.contains("csrcrp")) {
+        ClientSyncRecentConversationsResponse clientSyncRecentConversationsResponse;
+        Utils::packToMessage(mInitData["csrcrp"], clientSyncRecentConversationsResponse);
+        for (int i=0; i < clientSyncRecentConversationsResponse.conversationstate_size(); i++) {
+            const ClientConversationState &conv = clientSyncRecentConversationsResponse.conversationstate(i);
+            IdHandle convId = IdTable::intern(conv.conversationid().id());
+            mConversations.insert(convId, new ClientConversationState(conv));
+            indexParticipants(convId, conv.conversation());
+            mCompletions.setConversation(convId, conv.conversation());
+            seedUnreadState(convId, conv);
+        }
+    }
+    mInitData.clear();
+    saveSnapshot();
+}
+
 void HangishClient::onAuthenticationDone(QMap<QString, QNetworkCookie> cookies)
 {
     mSessionCookies = cookies;
     mNetworkAccessManager.setCookieJar(new QNetworkCookieJar(this));
-    getPVTToken();
+    // skip the init page when we still have everything it provides
+    if (mMyself.has_id() && loadInitCache()) {
+        qDebug() << "Using cached chat init configuration";
+        mUsingCachedInit = true;
+        skipPhase(BOOTSTRAP_PVT_TOKEN);
+        skipPhase(BOOTSTRAP_INIT_PAGE);
+        skipPhase(BOOTSTRAP_INIT_DECODE);
+    } else {
+        mUsingCachedInit = false;
+    }
+    if (mBootstrapPhases[BOOTSTRAP_AUTHENTICATION].startedAt < 0) {
+        // cookies arrived after an interactive login
+        mBootstrapPhases[BOOTSTRAP_AUTHENTICATION].startedAt = mConnectTimer.elapsed();
+    }
+    finishPhase(BOOTSTRAP_AUTHENTICATION);
+}
+
+bool HangishClient::loadInitCache()
+{
+    QFile cacheFile(mCookiePath + ".init");
+    if (!cacheFile.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    QJsonObject obj = QJsonDocument::fromJson(cacheFile.readAll()).object();
+    cacheFile.close();
+    if (obj.value("expires").toVariant().toLongLong() < QDateTime::currentMSecsSinceEpoch()) {
+        return false;
+    }
+    QString apiKey = obj.value("apiKey").toString();
+    QString channelPath = obj.value("channelPath").toString();
+    QString headerId = obj.value("headerId").toString();
+    if (apiKey.isEmpty() || channelPath.isEmpty() || headerId.isEmpty()) {
+        return false;
+    }
+    mApiKey = apiKey;
+    mChannelPath = channelPath;
+    mChannelEcParam = obj.value("ecParam").toString();
+    mChannelPropParam = obj.value("propParam").toString();
+    mHeaderId = headerId;
+    mHeaderDate = obj.value("headerDate").toString();
+    mHeaderVersion = obj.value("headerVersion").toString();
+    return true;
+}
+
+void HangishClient::saveInitCache()
+{
+    QJsonObject obj;
+    obj["apiKey"] = mApiKey;
+    obj["channelPath"] = mChannelPath;
+    obj["ecParam"] = mChannelEcParam;
+    obj["propParam"] = mChannelPropParam;
+    obj["headerId"] = mHeaderId;
+    obj["headerDate"] = mHeaderDate;
+    obj["headerVersion"] = mHeaderVersion;
+    obj["expires"] = QJsonValue::fromVariant(QDateTime::currentMSecsSinceEpoch() + INIT_CACHE_TTL_SECS * 1000LL);
+
+    QSaveFile cacheFile(mCookiePath + ".init");
+    if (cacheFile.open(QIODevice::WriteOnly)) {
+        cacheFile.write(QJsonDocument(obj).toJson());
+        cacheFile.commit();
+    }
+}
+
+void HangishClient::discardInitCache()
+{
+    qDebug() << "Cached chat init configuration rejected, running full init";
+    QFile::remove(mCookiePath + ".init");
+    mUsingCachedInit = false;
+    // the full init must not see, or save again, the rejected values
+    mApiKey.clear();
+    mChannelPath.clear();
+    mChannelEcParam.clear();
+    mChannelPropParam.clear();
+    mHeaderId.clear();
+    mHeaderDate.clear();
+    mHeaderVersion.clear();
+    if (mChannel) {
+        hangishDisconnect();
+    }
+    // the cookies are still good, redo everything that came after them
+    resetBootstrap(BOOTSTRAP_PVT_TOKEN);
+    startReadyPhases();
 }
 
 void HangishClient::getPVTToken()
@@ -926,10 +1737,14 @@ void HangishClient::onGetPVTTokenReply()
         reply->close();
 
         if (!pvttoken.has_token()) {
+            // the cookies are not good enough, authentication starts over
+            resetBootstrap();
+            mBootstrapPhases[BOOTSTRAP_AUTHENTICATION].startedAt = mConnectTimer.elapsed();
             mAuthenticator->getGalxToken();
         } else {
             mNetworkAccessManager.setCookieJar(new QNetworkCookieJar(this));
-            initChat(pvttoken.token().c_str());
+            mPvtToken = pvttoken.token().c_str();
+            finishPhase(BOOTSTRAP_PVT_TOKEN);
         }
     } else {
         qDebug() << "Pvt req returned " << reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
@@ -951,45 +1766,968 @@ void HangishClient::onClientBatchUpdate(ClientBatchUpdate &cbu)
 {
     for (int i = 0; i < cbu.stateupdate_size(); i++) {
         ClientStateUpdate update = cbu.stateupdate(i);
+        if (update.has_eventnotification() && update.eventnotification().has_event()) {
+            deliverEvent(update.eventnotification().event());
+        }
+        if (update.has_stateupdateheader() && update.stateupdateheader().currentservertime() > mLastSyncTimestamp) {
+            mLastSyncTimestamp = update.stateupdateheader().currentservertime();
+        }
+        applyStateUpdate(update);
         Q_EMIT clientStateUpdate(update);
     }
 }
 
-void HangishClient::sendCredentials(const QString &uname, const QString &passwd)
+static bool sameParticipant(const ClientParticipantId &a, const ClientParticipantId &b)
 {
-    mAuthenticator->sendCredentials(uname, passwd);
+    if (a.has_chatid() && b.has_chatid()) {
+        return a.chatid() == b.chatid();
+    }
+    return a.has_gaiaid() && b.has_gaiaid() && a.gaiaid() == b.gaiaid();
 }
 
-void HangishClient::sendChallengePin(const QString &pin)
+static void mergeConversation(ClientConversation *conversation, const ClientConversation &delta)
 {
-    mAuthenticator->sendChallengePin(pin);
+    // repeated fields carry the complete list, they replace what we had
+    if (delta.participant_size()) {
+        conversation->clear_participant();
+    }
+    if (delta.inactiveparticipant_size()) {
+        conversation->clear_inactiveparticipant();
+    }
+    if (delta.readstate_size()) {
+        conversation->clear_readstate();
+    }
+    if (delta.currentparticipant_size()) {
+        conversation->clear_currentparticipant();
+    }
+    if (delta.participantdata_size()) {
+        conversation->clear_participantdata();
+    }
+    if (delta.has_selfconversationstate() && delta.selfconversationstate().view_size()) {
+        conversation->mutable_selfconversationstate()->clear_view();
+    }
+    conversation->MergeFrom(delta);
 }
 
-void HangishClient::deleteCookies()
+static void setReadState(ClientConversation *conversation, const ClientParticipantId &participantId, quint64 latestReadTimestamp)
 {
-    QFile cookieFile(mCookiePath);
-    cookieFile.remove();
-    exit(0);
+    for (int i = 0; i < conversation->readstate_size(); i++) {
+        ClientUserReadState *readState = conversation->mutable_readstate(i);
+        if (sameParticipant(readState->participantid(), participantId)) {
+            if (latestReadTimestamp > readState->latestreadtimestamp()) {
+                readState->set_latestreadtimestamp(latestReadTimestamp);
+            }
+            return;
+        }
+    }
+    ClientUserReadState *readState = conversation->add_readstate();
+    readState->mutable_participantid()->CopyFrom(participantId);
+    readState->set_latestreadtimestamp(latestReadTimestamp);
 }
 
-void HangishClient::onChannelRestored(quint64 lastRec)
+static void applyMembershipChange(ClientConversation *conversation, const ClientMembershipChange &change)
 {
-    //If there was another pending req use its ts (that should be older)
-    if (!mNeedSync) {
-        mNeedSync = true;
-        mNeedSyncTS = lastRec;
+    if (change.type() == JOIN) {
+        for (int i = 0; i < change.participant_size(); i++) {
+            const ClientParticipant &participant = change.participant(i);
+            bool known = false;
+            for (int j = 0; j < conversation->participantdata_size() && !known; j++) {
+                known = sameParticipant(conversation->participantdata(j).id(), participant.id());
+            }
+            if (!known) {
+                ClientConversationParticipantData *data = conversation->add_participantdata();
+                data->mutable_id()->CopyFrom(participant.id());
+                data->set_fallbackname(participant.fullname());
+            }
+        }
+        for (int i = 0; i < change.participantid_size(); i++) {
+            bool known = false;
+            for (int j = 0; j < conversation->currentparticipant_size() && !known; j++) {
+                known = sameParticipant(conversation->currentparticipant(j), change.participantid(i));
+            }
+            if (!known) {
+                conversation->add_currentparticipant()->CopyFrom(change.participantid(i));
+            }
+        }
+    } else if (change.type() == LEAVE) {
+        for (int i = 0; i < change.participantid_size(); i++) {
+            const ClientParticipantId &left = change.participantid(i);
+            for (int j = conversation->currentparticipant_size() - 1; j >= 0; j--) {
+                if (sameParticipant(conversation->currentparticipant(j), left)) {
+                    conversation->mutable_currentparticipant()->DeleteSubrange(j, 1);
+                }
+            }
+            for (int j = conversation->participantdata_size() - 1; j >= 0; j--) {
+                if (sameParticipant(conversation->participantdata(j).id(), left)) {
+                    conversation->mutable_participantdata()->DeleteSubrange(j, 1);
+                }
+            }
+        }
     }
-    qDebug() << "Channel restored, gonna sync with " << lastRec;
-    syncAllNewEvents(mNeedSyncTS);
-    Q_EMIT channelRestored();
 }
 
-void HangishClient::updateClientId(QString newID)
+void HangishClient::applyStateUpdate(const ClientStateUpdate &update)
 {
-    qDebug() << "Updating mClid " << newID << sender();
-    bool initDone = mClid.isEmpty();
-    mClid = newID;
-    if (initDone) {
-        Q_EMIT initFinished();
+    if (update.has_conversationnotification() && update.conversationnotification().has_conversation()) {
+        ClientConversationState state;
+        state.mutable_conversationid()->CopyFrom(update.conversationnotification().conversation().id());
+        state.mutable_conversation()->CopyFrom(update.conversationnotification().conversation());
+        mergeConversationState(state);
+    }
+    if (update.has_clientconversation()) {
+        ClientConversationState state;
+        state.mutable_conversationid()->CopyFrom(update.clientconversation().id());
+        state.mutable_conversation()->CopyFrom(update.clientconversation());
+        mergeConversationState(state);
+    }
+    if (update.has_eventnotification() && update.eventnotification().has_event()) {
+        addConversationEvent(update.eventnotification().event());
+    }
+    if (update.has_watermarknotification()) {
+        const ClientWatermarkNotification &watermark = update.watermarknotification();
+        if (mConversations.contains(IdTable::find(watermark.conversationid().id()))) {
+            ClientConversation *conversation = detachConversation(watermark.conversationid())->mutable_conversation();
+            setReadState(conversation, watermark.participantid(), watermark.latestreadtimestamp());
+            if (mMyself.has_id() && sameParticipant(watermark.participantid(), mMyself.id())) {
+                ClientUserReadState *selfReadState = conversation->mutable_selfconversationstate()->mutable_selfreadstate();
+                if (watermark.latestreadtimestamp() > selfReadState->latestreadtimestamp()) {
+                    selfReadState->mutable_participantid()->CopyFrom(watermark.participantid());
+                    selfReadState->set_latestreadtimestamp(watermark.latestreadtimestamp());
+                }
+                markConversationRead(IdTable::find(watermark.conversationid().id()), watermark.latestreadtimestamp());
+            }
+            mConversations.update(IdTable::find(watermark.conversationid().id()));
+        }
+    }
+    if (update.has_presencenotification()) {
+        for (int i = 0; i < update.presencenotification().presence_size(); i++) {
+            const ClientPresenceResult &result = update.presencenotification().presence(i);
+            if (result.has_presence()) {
+                updatePresence(result.userid(), result.presence());
+            }
+        }
+    }
+    if (update.has_selfpresencenotification() && update.selfpresencenotification().has_presence() && mMyself.has_id()) {
+        updatePresence(mMyself.id(), update.selfpresencenotification().presence());
+    }
+    if (update.has_clientconversation()) {
+        queueGapCheck(IdTable::intern(update.clientconversation().id().id()),
+                      update.clientconversation().selfconversationstate().sorttimestamp());
+    }
+    if (update.has_deletenotification()) {
+        const ClientDeleteActionNotification &deletion = update.deletenotification();
+        if (mConversations.contains(IdTable::find(deletion.conversationid().id()))) {
+            ClientConversationState *state = detachConversation(deletion.conversationid());
+            quint64 upperBound = deletion.deleteaction().deleteupperboundtimestamp();
+            int deleted = 0;
+            while (deleted < state->event_size() && state->event(deleted).timestamp() <= upperBound) {
+                deleted++;
+            }
+            state->mutable_event()->DeleteSubrange(0, deleted);
+            state->add_deleteaction()->CopyFrom(deletion.deleteaction());
+            mConversations.update(IdTable::find(deletion.conversationid().id()));
+        }
+    }
+}
+
+ClientConversationState *HangishClient::detachConversation(const ClientConversationId &id)
+{
+    // handed out states are never modified, the cache copies them if needed
+    IdHandle convId = IdTable::intern(id.id());
+    ClientConversationState *state = mConversations.detach(convId);
+    if (!state) {
+        state = new ClientConversationState();
+        state->mutable_conversationid()->CopyFrom(id);
+        mConversations.insert(convId, state);
+    }
+    return state;
+}
+
+static bool isNewestEvent(const ClientConversationState &state, const ClientEvent &event)
+{
+    if (state.event_size()) {
+        return event.timestamp() >= state.event(state.event_size() - 1).timestamp();
+    }
+    return (qint64)event.timestamp() >= state.conversation().selfconversationstate().sorttimestamp();
+}
+
+static bool addEvent(ClientConversationState *state, const ClientEvent &event)
+{
+    // events mostly arrive in order, walk back from the newest one
+    int pos = state->event_size();
+    while (pos > 0 && state->event(pos - 1).timestamp() > event.timestamp()) {
+        pos--;
+    }
+    for (int i = pos - 1; i >= 0 && state->event(i).timestamp() == event.timestamp(); i--) {
+        if (state->event(i).eventid() == event.eventid()) {
+            return false;
+        }
+    }
+    if (pos == 0 && state->event_size() >= CONVERSATION_MAX_EVENTS) {
+        return false;
+    }
+    bool newest = isNewestEvent(*state, event);
+    state->add_event()->CopyFrom(event);
+    for (int i = state->event_size() - 1; i > pos; i--) {
+        state->mutable_event()->SwapElements(i, i - 1);
+    }
+    if (state->event_size() > CONVERSATION_MAX_EVENTS) {
+        state->mutable_event()->DeleteSubrange(0, state->event_size() - CONVERSATION_MAX_EVENTS);
+    }
+    // older history must not roll back what the deltas already told us
+    if (!newest) {
+        return true;
+    }
+
+    ClientConversation *conversation = state->mutable_conversation();
+    if (event.has_conversationrename()) {
+        conversation->set_name(event.conversationrename().newname());
+    }
+    if (event.has_membershipchange()) {
+        applyMembershipChange(conversation, event.membershipchange());
+    }
+    if (event.advancessorttimestamp() &&
+        (qint64)event.timestamp() > conversation->selfconversationstate().sorttimestamp()) {
+        conversation->mutable_selfconversationstate()->set_sorttimestamp(event.timestamp());
+    }
+    if (event.has_senderid()) {
+        setReadState(conversation, event.senderid(), event.timestamp());
+    }
+    return true;
+}
+
+void HangishClient::mergeConversationState(const ClientConversationState &state)
+{
+    IdHandle convId = IdTable::intern(state.conversationid().id());
+    if (!convId) {
+        return;
+    }
+    if (!mConversations.contains(convId) && !state.has_conversation()) {
+        prefetchConversation(convId);
+    }
+    ClientConversationState *known = detachConversation(state.conversationid());
+    if (state.has_conversation()) {
+        mergeConversation(known->mutable_conversation(), state.conversation());
+        if (state.conversation().participant_size() || state.conversation().participantdata_size()) {
+            indexParticipants(convId, known->conversation());
+        }
+    }
+    if (state.has_eventcontinuationtoken()) {
+        known->mutable_eventcontinuationtoken()->CopyFrom(state.eventcontinuationtoken());
+    }
+    if (state.has_leavetimestamp()) {
+        known->set_leavetimestamp(state.leavetimestamp());
+    }
+    bool seeded = mUnread.contains(convId);
+    for (int i = 0; i < state.event_size(); i++) {
+        bool newest = isNewestEvent(*known, state.event(i));
+        if (!addEvent(known, state.event(i))) {
+            continue;
+        }
+        if (newest && state.event(i).has_membershipchange()) {
+            updateParticipantIndex(convId, state.event(i).membershipchange());
+        }
+        if (seeded) {
+            trackUnreadEvent(convId, state.event(i));
+        }
+    }
+    mConversations.update(convId);
+    mCompletions.setConversation(convId, known->conversation());
+    if (!seeded) {
+        seedUnreadState(convId, *known);
+    } else if (known->conversation().selfconversationstate().has_selfreadstate()) {
+        markConversationRead(convId, known->conversation().selfconversationstate().selfreadstate().latestreadtimestamp());
+    }
+}
+
+void HangishClient::addConversationEvent(const ClientEvent &event)
+{
+    IdHandle convId = IdTable::intern(event.conversationid().id());
+    if (!convId) {
+        return;
+    }
+    if (!mConversations.contains(convId)) {
+        prefetchConversation(convId);
+    }
+    ClientConversationState *state = detachConversation(event.conversationid());
+    bool newest = isNewestEvent(*state, event);
+    if (!addEvent(state, event)) {
+        return;
+    }
+    mConversations.update(convId);
+    if (newest && event.has_membershipchange()) {
+        updateParticipantIndex(convId, event.membershipchange());
+    }
+    mCompletions.setConversation(convId, state->conversation());
+    if (mUnread.contains(convId)) {
+        trackUnreadEvent(convId, event);
+    } else {
+        seedUnreadState(convId, *state);
+    }
+}
+
+static IdHandle participantKey(const ClientParticipantId &id)
+{
+    return IdTable::intern(id.has_chatid() ? id.chatid() : id.gaiaid());
+}
+
+static ClientEntityPtr participantEntity(const ClientParticipant &participant)
+{
+    ClientEntity *entity = new ClientEntity();
+    entity->mutable_id()->CopyFrom(participant.id());
+    ClientEntityProperties *properties = entity->mutable_properties();
+    properties->set_displayname(participant.fullname());
+    if (participant.has_firstname()) {
+        properties->set_firstname(participant.firstname());
+    }
+    if (participant.has_profilephotourl()) {
+        properties->set_photourl(participant.profilephotourl());
+    }
+    return ClientEntityPtr(entity);
+}
+
+void HangishClient::indexParticipants(IdHandle convId, const ClientConversation &conversation)
+{
+    // former members stay, their old messages still need a sender
+    QHash<IdHandle, ClientEntityPtr> &index = mParticipants[convId];
+    for (int i = 0; i < conversation.participantdata_size(); i++) {
+        const ClientConversationParticipantData &data = conversation.participantdata(i);
+        ClientParticipant participant;
+        participant.mutable_id()->CopyFrom(data.id());
+        participant.set_fullname(data.fallbackname());
+        index.insert(participantKey(data.id()), participantEntity(participant));
+    }
+    // full participant entries carry more than the fallback name
+    for (int i = 0; i < conversation.participant_size(); i++) {
+        index.insert(participantKey(conversation.participant(i).id()), participantEntity(conversation.participant(i)));
+    }
+}
+
+void HangishClient::updateParticipantIndex(IdHandle convId, const ClientMembershipChange &change)
+{
+    // members who leave are kept, only joins add to the index
+    if (change.type() != JOIN) {
+        return;
+    }
+    QHash<IdHandle, ClientEntityPtr> &index = mParticipants[convId];
+    for (int i = 0; i < change.participant_size(); i++) {
+        index.insert(participantKey(change.participant(i).id()), participantEntity(change.participant(i)));
+    }
+    for (int i = 0; i < change.participantid_size(); i++) {
+        IdHandle id = participantKey(change.participantid(i));
+        if (!index.contains(id)) {
+            ClientParticipant participant;
+            participant.mutable_id()->CopyFrom(change.participantid(i));
+            index.insert(id, participantEntity(participant));
+        }
+    }
+}
+
+void HangishClient::seedUnreadState(IdHandle convId, const ClientConversationState &state)
+{
+    const ClientUserConversationState &self = state.conversation().selfconversationstate();
+    UnreadState unread;
+    unread.readTimestamp = self.selfreadstate().latestreadtimestamp();
+    bool sentBySelf = false;
+    for (int i = 0; i < state.event_size(); i++) {
+        const ClientEvent &event = state.event(i);
+        if (mMyself.has_id() && sameParticipant(event.senderid(), mMyself.id())) {
+            unread.readTimestamp = qMax(unread.readTimestamp, (quint64)event.timestamp());
+            unread.events.clear();
+            sentBySelf = true;
+        } else if (event.timestamp() > unread.readTimestamp) {
+            unread.events.append(event.timestamp());
+        }
+    }
+    if (self.has_unreadeventcount() && !sentBySelf) {
+        unread.untracked = qMax(0, self.unreadeventcount() - unread.events.size());
+    }
+    int before = mUnread.value(convId).count();
+    mUnread.insert(convId, unread);
+    notifyUnreadCount(convId, before);
+}
+
+void HangishClient::trackUnreadEvent(IdHandle convId, const ClientEvent &event)
+{
+    if (mMyself.has_id() && sameParticipant(event.senderid(), mMyself.id())) {
+        // whoever answers has read everything before
+        markConversationRead(convId, event.timestamp());
+        return;
+    }
+    UnreadState &unread = mUnread[convId];
+    if (event.timestamp() <= unread.readTimestamp) {
+        return;
+    }
+    int before = unread.count();
+    QVector<quint64>::iterator pos = std::lower_bound(unread.events.begin(), unread.events.end(), (quint64)event.timestamp());
+    if (pos == unread.events.begin() && !unread.events.isEmpty() && unread.untracked > 0) {
+        // older history the server had already counted
+        unread.untracked--;
+    }
+    unread.events.insert(pos, event.timestamp());
+    notifyUnreadCount(convId, before);
+}
+
+void HangishClient::markConversationRead(IdHandle convId, quint64 timestamp)
+{
+    QHash<IdHandle, UnreadState>::iterator it = mUnread.find(convId);
+    if (it == mUnread.end() || timestamp <= it->readTimestamp) {
+        return;
+    }
+    int before = it->count();
+    it->readTimestamp = timestamp;
+    it->untracked = 0;
+    it->events.erase(it->events.begin(), std::upper_bound(it->events.begin(), it->events.end(), timestamp));
+    notifyUnreadCount(convId, before);
+}
+
+void HangishClient::notifyUnreadCount(IdHandle convId, int before)
+{
+    int count = mUnread.value(convId).count();
+    if (count == before) {
+        return;
+    }
+    mTotalUnread += count - before;
+    Q_EMIT unreadCountChanged(IdTable::toString(convId), count);
+}
+
+int HangishClient::getUnreadCount(const QString &convId) const
+{
+    return mUnread.value(IdTable::find(convId)).count();
+}
+
+int HangishClient::getTotalUnreadCount() const
+{
+    return mTotalUnread;
+}
+
+quint64 HangishClient::getLatestReadTimestamp(const QString &convId) const
+{
+    return mUnread.value(IdTable::find(convId)).readTimestamp;
+}
+
+void HangishClient::prefetchConversation(IdHandle convId)
+{
+    if (mPrefetchingConversations.contains(convId)) {
+        return;
+    }
+    mPrefetchingConversations.insert(convId);
+
+    ClientGetConversationRequest request;
+    request.set_allocated_requestheader(getRequestHeader1());
+    request.mutable_conversationspec()->mutable_conversationid()->set_id(IdTable::toStdString(convId));
+    request.set_includeconversationmetadata(true);
+    request.set_includeevent(false);
+    QNetworkReply *reply = sendRequest("conversations/getconversation", Utils::msgToJsArray(request));
+    reply->setProperty("hangishConversationId", convId);
+    QObject::connect(reply, SIGNAL(finished()), this, SLOT(onConversationPrefetched()));
+}
+
+void HangishClient::onConversationPrefetched()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
+    IdHandle convId = reply->property("hangishConversationId").toUInt();
+    mPrefetchingConversations.remove(convId);
+
+    if (reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt()==200) {
+        ClientGetConversationResponse cgcr;
+        QVariantList variantListResponse = Utils::jsArrayToVariantList(reply->readAll());
+        if (!variantListResponse.isEmpty() && variantListResponse[0].toString() == "cgcrp") {
+            variantListResponse.pop_front();
+            Utils::packToMessage(QVariantList() << variantListResponse, cgcr);
+            mergeConversationState(cgcr.conversationstate());
+        }
+    } else {
+        qDebug() << "Could not prefetch conversation" << IdTable::toString(convId)
+                 << reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    }
+    reply->deleteLater();
+}
+
+void HangishClient::sendCredentials(const QString &uname, const QString &passwd)
+{
+    mAuthenticator->sendCredentials(uname, passwd);
+}
+
+void HangishClient::sendChallengePin(const QString &pin)
+{
+    mAuthenticator->sendChallengePin(pin);
+}
+
+void HangishClient::deleteCookies()
+{
+    QFile cookieFile(mCookiePath);
+    cookieFile.remove();
+    // the next account must not start from this one's cached state
+    mSnapshotTimer.stop();
+    QFile::remove(mCookiePath + ".snapshot");
+    QFile::remove(mCookiePath + ".init");
+    exit(0);
+}
+
+void HangishClient::onChannelRestored(quint64 lastRec)
+{
+    if (lastRec) {
+        // only the conversations that moved while we were away get fetched
+        qDebug() << "Channel restored, looking for gaps since" << lastRec;
+        scanForGaps(lastRec, 0);
+        Q_EMIT channelRestored();
+        return;
+    }
+
+    //If there was another pending req use its ts (that should be older)
+    if (!mNeedSync) {
+        mNeedSync = true;
+        mNeedSyncTS = lastRec;
+    }
+    qDebug() << "Channel restored, gonna sync with " << lastRec;
+    syncAllNewEvents(mNeedSyncTS);
+    Q_EMIT channelRestored();
+}
+
+void HangishClient::updateClientId(QString newID)
+{
+    qDebug() << "Updating mClid " << newID << sender();
+    bool initDone = mClid.isEmpty();
+    mClid = newID;
+    if (initDone) {
+        qDebug() << "Connected in" << mConnectTimer.elapsed() << "ms" << (mUsingCachedInit ? "(warm start)" : "(cold start)");
+        finishPhase(BOOTSTRAP_CHANNEL_SID);
+        Q_EMIT initFinished();
+    }
+}
+
+void HangishClient::openHistory(const QString &convId)
+{
+    IdHandle conversation = IdTable::intern(convId);
+    if (mHistoryCursors.contains(conversation)) {
+        return;
+    }
+    HistoryCursor &cursor = mHistoryCursors[conversation];
+
+    // continue from where the known part of the conversation ends
+    ConversationStatePtr state = mConversations.value(conversation);
+    if (state && state->has_eventcontinuationtoken()) {
+        cursor.token.CopyFrom(state->eventcontinuationtoken());
+    } else if (state && state->event_size()) {
+        cursor.token.set_eventtimestamp(state->event(0).timestamp());
+    }
+    // without a token the first page holds the most recent events
+    fillHistoryWindow(conversation);
+}
+
+void HangishClient::setHistoryPosition(const QString &convId, quint64 oldestVisibleTimestamp)
+{
+    IdHandle conversation = IdTable::find(convId);
+    if (!mHistoryCursors.contains(conversation)) {
+        return;
+    }
+    mHistoryCursors[conversation].position = oldestVisibleTimestamp;
+    fillHistoryWindow(conversation);
+}
+
+void HangishClient::closeHistory(const QString &convId)
+{
+    mHistoryCursors.remove(IdTable::find(convId));
+}
+
+void HangishClient::setHistoryPrefetchWindow(int pages)
+{
+    mHistoryPrefetchWindow = pages;
+}
+
+void HangishClient::fillHistoryWindow(IdHandle convId)
+{
+    HistoryCursor &cursor = mHistoryCursors[convId];
+    if (cursor.inFlight || cursor.exhausted) {
+        return;
+    }
+    int ahead = 0;
+    Q_FOREACH (quint64 oldest, cursor.pages) {
+        if (!cursor.position || oldest < cursor.position) {
+            ahead++;
+        }
+    }
+    if (ahead >= mHistoryPrefetchWindow) {
+        return;
+    }
+
+    ClientGetConversationRequest request;
+    request.set_allocated_requestheader(getRequestHeader1());
+    request.mutable_conversationspec()->mutable_conversationid()->set_id(IdTable::toStdString(convId));
+    request.set_includeconversationmetadata(false);
+    request.set_includeevent(true);
+    request.set_maxeventsperconversation(HISTORY_PAGE_SIZE);
+    if (cursor.token.ByteSize() > 0) {
+        request.mutable_eventcontinuationtoken()->CopyFrom(cursor.token);
+    }
+    // history must not hold up what the user is waiting for
+    QNetworkReply *reply = sendRequest("conversations/getconversation", Utils::msgToJsArray(request), QNetworkRequest::LowPriority);
+    reply->setProperty("hangishConversationId", convId);
+    QObject::connect(reply, SIGNAL(finished()), this, SLOT(onHistoryPageReply()));
+    cursor.inFlight = true;
+}
+
+void HangishClient::onHistoryPageReply()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
+    IdHandle convId = reply->property("hangishConversationId").toUInt();
+    reply->deleteLater();
+    if (!mHistoryCursors.contains(convId)) {
+        // closed while the page was on its way
+        return;
+    }
+    HistoryCursor &cursor = mHistoryCursors[convId];
+    cursor.inFlight = false;
+
+    if (reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt()!=200) {
+        qDebug() << "There was an error prefetching history! " << reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        return;
+    }
+    ClientGetConversationResponse cgcr;
+    QVariantList variantListResponse = Utils::jsArrayToVariantList(reply->readAll());
+    if (variantListResponse.isEmpty() || variantListResponse[0].toString() != "cgcrp") {
+        return;
+    }
+    variantListResponse.pop_front();
+    Utils::packToMessage(QVariantList() << variantListResponse, cgcr);
+
+    ClientConversationState state = cgcr.conversationstate();
+    if (cgcr.has_error() || state.event_size() == 0) {
+        // INVALID_CONTINUATION_TOKEN or nothing older left
+        cursor.exhausted = true;
+    } else {
+        deliverEvents(state);
+        quint64 oldest = state.event(0).timestamp();
+        for (int i = 1; i < state.event_size(); i++) {
+            oldest = qMin(oldest, (quint64)state.event(i).timestamp());
+        }
+        cursor.pages.append(oldest);
+        if (state.has_eventcontinuationtoken()) {
+            cursor.token.CopyFrom(state.eventcontinuationtoken());
+        } else {
+            cursor.exhausted = true;
+        }
+        Q_EMIT historyPrefetched(IdTable::toString(convId), state);
+    }
+
+    // the signal may have closed the history
+    if (!mHistoryCursors.contains(convId)) {
+        return;
+    }
+    if (mHistoryCursors[convId].exhausted) {
+        Q_EMIT historyExhausted(IdTable::toString(convId));
+    } else {
+        fillHistoryWindow(convId);
+    }
+}
+
+void HangishClient::setSyncFilters(const QList<ClientSyncFilter> &filters)
+{
+    mSyncFilters = filters;
+}
+
+bool HangishClient::queueCatchUp(IdHandle convId)
+{
+    // queued or in flight until it succeeds or falls back to a full sync
+    if (mCatchUpAttempts.contains(convId)) {
+        return false;
+    }
+    mCatchUpAttempts[convId] = 0;
+    mCatchUpQueue.append(convId);
+    return true;
+}
+
+void HangishClient::startCatchUps()
+{
+    while (mCatchUpsInFlight < SYNC_CATCHUP_PARALLEL && !mCatchUpQueue.isEmpty()) {
+        IdHandle convId = mCatchUpQueue.takeFirst();
+        mCatchUpAttempts[convId]++;
+        ClientGetConversationRequest request;
+        request.set_allocated_requestheader(getRequestHeader1());
+        request.mutable_conversationspec()->mutable_conversationid()->set_id(IdTable::toStdString(convId));
+        request.set_includeconversationmetadata(true);
+        request.set_includeevent(true);
+        request.set_maxeventsperconversation(CONVERSATION_MAX_EVENTS);
+        QNetworkReply *reply = sendRequest("conversations/getconversation", Utils::msgToJsArray(request));
+        reply->setProperty("hangishConversationId", convId);
+        QObject::connect(reply, SIGNAL(finished()), this, SLOT(onCatchUpReply()));
+        mCatchUpsInFlight++;
+    }
+}
+
+void HangishClient::onCatchUpReply()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
+    IdHandle convId = reply->property("hangishConversationId").toUInt();
+    mCatchUpsInFlight--;
+
+    bool caughtUp = false;
+    if (reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt()==200) {
+        ClientGetConversationResponse cgcr;
+        QVariantList variantListResponse = Utils::jsArrayToVariantList(reply->readAll());
+        if (!variantListResponse.isEmpty() && variantListResponse[0].toString() == "cgcrp") {
+            variantListResponse.pop_front();
+            Utils::packToMessage(QVariantList() << variantListResponse, cgcr);
+            deliverEvents(cgcr.conversationstate());
+            mergeConversationState(cgcr.conversationstate());
+            // the server state is current, nothing before it is missing
+            quint64 sortTimestamp = cgcr.conversationstate().conversation().selfconversationstate().sorttimestamp();
+            if (sortTimestamp > lastEventTimestamp(convId)) {
+                mLastEventTimestamps[convId] = sortTimestamp;
+            }
+            caughtUp = true;
+
+            // delivered the same way as a regular sync
+            ClientConversationState state = cgcr.conversationstate();
+            Q_EMIT conversationStateSynced(state);
+        }
+    } else {
+        qDebug() << "There was an error catching up a conversation! " << reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    }
+
+    if (caughtUp) {
+        mCatchUpAttempts.remove(convId);
+    } else if (mCatchUpAttempts.value(convId) < SYNC_CATCHUP_ATTEMPTS) {
+        mCatchUpQueue.append(convId);
+    } else {
+        qDebug() << "Could not catch up" << IdTable::toString(convId) << "falling back to a full sync";
+        mCatchUpAttempts.remove(convId);
+        syncAllNewEvents(lastEventTimestamp(convId));
+    }
+    reply->deleteLater();
+    startCatchUps();
+}
+
+quint64 HangishClient::lastEventTimestamp(IdHandle convId)
+{
+    if (!mLastEventTimestamps.contains(convId)) {
+        quint64 timestamp = 0;
+        if (mEventStore) {
+            timestamp = mEventStore->newestTimestamp(IdTable::toString(convId));
+        }
+        ConversationStatePtr state = mConversations.peek(convId);
+        if (state && state->event_size()) {
+            timestamp = qMax(timestamp, (quint64)state->event(state->event_size() - 1).timestamp());
+        }
+        mLastEventTimestamps[convId] = timestamp;
+    }
+    return mLastEventTimestamps.value(convId);
+}
+
+void HangishClient::checkConversationGap(IdHandle convId, quint64 sortTimestamp)
+{
+    if (!convId || sortTimestamp <= lastEventTimestamp(convId) || mCatchUpAttempts.contains(convId)) {
+        return;
+    }
+    // the conversation moved past the newest event we have seen
+    qDebug() << "Gap in" << IdTable::toString(convId) << "repairing";
+    queueCatchUp(convId);
+    startCatchUps();
+}
+
+void HangishClient::queueGapCheck(IdHandle convId, quint64 sortTimestamp)
+{
+    // the delta often comes before its event, later in the batch or in the next one
+    if (convId && sortTimestamp > mPendingGapChecks.value(convId)) {
+        mPendingGapChecks[convId] = sortTimestamp;
+    }
+    if (!mGapCheckTimer.isActive()) {
+        mGapCheckTimer.start(GAP_CHECK_DELAY_MSECS);
+    }
+}
+
+void HangishClient::flushGapChecks()
+{
+    QHash<IdHandle, quint64> checks = mPendingGapChecks;
+    mPendingGapChecks.clear();
+    QHash<IdHandle, quint64>::const_iterator it;
+    for (it = checks.constBegin(); it != checks.constEnd(); ++it) {
+        checkConversationGap(it.key(), it.value());
+    }
+}
+
+void HangishClient::scanForGaps(quint64 since, qint64 endTimestamp)
+{
+    ClientSyncRecentConversationsRequest request;
+    request.set_allocated_requestheader(getRequestHeader1());
+    if (endTimestamp) {
+        request.set_endtimestamp(endTimestamp);
+    }
+    request.set_maxconversations(GAP_SCAN_PAGE_SIZE);
+    request.set_maxeventsperconversation(1);
+    Q_FOREACH (ClientSyncFilter filter, mSyncFilters) {
+        request.add_syncfilter(filter);
+    }
+    QNetworkReply *reply = sendRequest("conversations/syncrecentconversations", Utils::msgToJsArray(request));
+    reply->setProperty("hangishGapStart", since);
+    QObject::connect(reply, SIGNAL(finished()), this, SLOT(onGapScanReply()));
+}
+
+void HangishClient::onGapScanReply()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
+    quint64 since = reply->property("hangishGapStart").toULongLong();
+    reply->deleteLater();
+
+    ClientSyncRecentConversationsResponse csrcrp;
+    QVariantList variantListResponse;
+    if (reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt()==200) {
+        variantListResponse = Utils::jsArrayToVariantList(reply->readAll());
+    }
+    if (variantListResponse.isEmpty() || variantListResponse[0].toString() != "csrcrp") {
+        // could not tell what changed, fall back to a full sync
+        qDebug() << "Gap scan failed, syncing everything since" << since;
+        syncAllNewEvents(since);
+        return;
+    }
+    variantListResponse.pop_front();
+    Utils::packToMessage(QVariantList() << variantListResponse, csrcrp);
+
+    // conversations come newest first
+    bool reachedGapStart = csrcrp.conversationstate_size() < GAP_SCAN_PAGE_SIZE;
+    for (int i = 0; i < csrcrp.conversationstate_size(); i++) {
+        const ClientConversationState &state = csrcrp.conversationstate(i);
+        quint64 sortTimestamp = state.conversation().selfconversationstate().sorttimestamp();
+        if (sortTimestamp < since) {
+            reachedGapStart = true;
+            break;
+        }
+        checkConversationGap(IdTable::intern(state.conversationid().id()), sortTimestamp);
+    }
+    if (!reachedGapStart && csrcrp.continuationendtimestamp()) {
+        scanForGaps(since, csrcrp.continuationendtimestamp());
+    }
+}
+
+quint64 HangishClient::resolveEntities(const QStringList &chatIds)
+{
+    quint64 requestId = mCurrentRequestId++;
+    EntityWaiter waiter;
+    waiter.requestId = requestId;
+    Q_FOREACH(const QString &chatId, chatIds) {
+        IdHandle id = IdTable::intern(chatId);
+        if (queueEntityLookup(id) || mEntitiesInFlight.contains(id)) {
+            waiter.pending.insert(id);
+        }
+    }
+    mEntityWaiters.append(waiter);
+    // answered from the next flush, even when everything is known
+    if (!mEntityBatchTimer.isActive()) {
+        mEntityBatchTimer.start(ENTITY_BATCH_WINDOW_MSECS);
+    }
+    return requestId;
+}
+
+bool HangishClient::queueEntityLookup(IdHandle id)
+{
+    if (!id || mUsers.contains(id) || mEntitiesInFlight.contains(id)) {
+        return false;
+    }
+    if (mUnresolvedEntities.contains(id)) {
+        if (QDateTime::currentMSecsSinceEpoch() - mUnresolvedEntities[id] < ENTITY_NEGATIVE_TTL_SECS * 1000) {
+            return false;
+        }
+        mUnresolvedEntities.remove(id);
+    }
+    mQueuedEntities.insert(id);
+    if (!mEntityBatchTimer.isActive()) {
+        mEntityBatchTimer.start(ENTITY_BATCH_WINDOW_MSECS);
+    }
+    return true;
+}
+
+void HangishClient::flushEntityLookups()
+{
+    while (!mQueuedEntities.isEmpty()) {
+        ClientGetEntityByIdRequest clientGetEntityByIdRequest;
+        clientGetEntityByIdRequest.set_allocated_requestheader(getRequestHeader1());
+        QList<QVariant> batch;
+        QSet<IdHandle>::iterator it = mQueuedEntities.begin();
+        while (it != mQueuedEntities.end() && batch.size() < ENTITY_BATCH_SIZE) {
+            clientGetEntityByIdRequest.add_batchlookupspec()->set_gaiaid(IdTable::toStdString(*it));
+            mEntitiesInFlight.insert(*it);
+            batch.append(*it);
+            it = mQueuedEntities.erase(it);
+        }
+        QNetworkReply *reply = sendRequest("contacts/getentitybyid", Utils::msgToJsArray(clientGetEntityByIdRequest));
+        reply->setProperty("hangishEntityIds", batch);
+        QObject::connect(reply, SIGNAL(finished()), this, SLOT(getEntityByIdReply()));
+    }
+    // waiters with nothing in flight are done already
+    settleEntityWaiters(QSet<IdHandle>());
+}
+
+void HangishClient::getEntityByIdReply()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
+    QSet<IdHandle> batch;
+    Q_FOREACH(const QVariant &id, reply->property("hangishEntityIds").toList()) {
+        batch.insert(id.toUInt());
+    }
+    mEntitiesInFlight.subtract(batch);
+
+    ClientGetEntityByIdResponse cgebirp;
+    QVariantList variantListResponse;
+    if (reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt()==200) {
+        variantListResponse = Utils::jsArrayToVariantList(reply->readAll());
+    }
+    reply->deleteLater();
+    if (variantListResponse.isEmpty() || variantListResponse[0].toString() != "cgebirp") {
+        qDebug() << "There was an error resolving entities! " << reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        // not cached as unresolved, the next lookup tries again
+        QList<quint64> failed;
+        QList<EntityWaiter>::iterator waiter = mEntityWaiters.begin();
+        while (waiter != mEntityWaiters.end()) {
+            if (waiter->pending.intersects(batch)) {
+                failed.append(waiter->requestId);
+                waiter = mEntityWaiters.erase(waiter);
+            } else {
+                ++waiter;
+            }
+        }
+        Q_FOREACH(quint64 requestId, failed) {
+            Q_EMIT requestFailed(requestId);
+        }
+        return;
+    }
+    variantListResponse.pop_front();
+    Utils::packToMessage(QVariantList() << variantListResponse, cgebirp);
+
+    QSet<IdHandle> unresolved = batch;
+    for (int i = 0; i < cgebirp.entity_size(); i++) {
+        const ClientEntity &entity = cgebirp.entity(i);
+        IdHandle id = IdTable::intern(entity.id().has_chatid() ? entity.id().chatid() : entity.id().gaiaid());
+        if (!id) {
+            continue;
+        }
+        mUsers[id] = ClientEntityPtr(new ClientEntity(entity));
+        mCompletions.setUser(id, entity);
+        unresolved.remove(id);
+        Q_EMIT userResolved(IdTable::toString(id));
+    }
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    Q_FOREACH(IdHandle id, unresolved) {
+        mUnresolvedEntities[id] = now;
+    }
+    settleEntityWaiters(batch);
+}
+
+void HangishClient::settleEntityWaiters(const QSet<IdHandle> &ids)
+{
+    QList<quint64> resolved;
+    QList<EntityWaiter>::iterator waiter = mEntityWaiters.begin();
+    while (waiter != mEntityWaiters.end()) {
+        waiter->pending.subtract(ids);
+        if (waiter->pending.isEmpty()) {
+            resolved.append(waiter->requestId);
+            waiter = mEntityWaiters.erase(waiter);
+        } else {
+            ++waiter;
+        }
+    }
+    // emitted last, slots may queue new lookups
+    Q_FOREACH(quint64 requestId, resolved) {
+        Q_EMIT entitiesResolved(requestId);
     }
 }
@@ -25,10 +25,24 @@
 #include <QNetworkCookie>
 #include <QNetworkReply>
 #include <QNetworkCookieJar>
+#include <QScriptEngine>
 #include <QDateTime>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QSet>
+#include <QTimer>
+#include <QVariantMap>
 
 #include "authenticator.h"
 #include "channel.h"
+#include "completionindex.h"
+#include "conversationcache.h"
+#include "eventdeduplicator.h"
+#include "eventstore.h"
+#include "idtable.h"
+#include "imageuploader.h"
+#include "searchindex.h"
+#include "syncstreamdecoder.h"
 #include "types.h"
 
 class HangishClient : public QObject
@@ -37,13 +51,20 @@ class HangishClient : public QObject
 
 public:
     HangishClient(const QString &cookiePath);
+    ~HangishClient();
     QString getSelfChatId() const;
-    ClientConversationState getConvById(const QString &cid) const;
-    ClientEntity getUserById(const QString &chatId) const;
+    ConversationStatePtr getConvById(const QString &cid) const;
+    ClientEntityPtr getUserById(const QString &chatId) const;
+    ClientEntityPtr getParticipant(const QString &convId, const QString &chatId) const;
     void initChat(const QString &pvt);
     quint64 sendChatMessage(ClientSendChatMessageRequest clientSendChatMessageRequest);
     quint64 queryPresence(const QStringList &chatIds);
-    void sendImage(const QString &segments, const QString &conversationId, const QString &filename);
+    bool getPresence(const QString &chatId, ClientPresence &presence) const;
+    int getUnreadCount(const QString &convId) const;
+    int getTotalUnreadCount() const;
+    quint64 getLatestReadTimestamp(const QString &convId) const;
+    quint64 resolveEntities(const QStringList &chatIds);
+    quint64 sendImage(const QString &segments, const QString &conversationId, const QString &filename);
     void sendCredentials(const QString &uname, const QString &passwd);
     void sendChallengePin(const QString &pin);
     void deleteCookies();
@@ -55,17 +76,35 @@ public:
     void hangishDisconnect();
     void hangishConnect(quint64 lastKnownPushTs = 0);
     ClientEntity getMyself() const;
-    QMap<QString, ClientEntity> getUsers() const;
+    IdHashIterator<ClientEntityPtr> getUsers() const;
+    ConversationCache::Iterator getConversations() const;
+    void setConversationCacheBudget(qint64 bytes);
+    QVariantMap memoryUsage() const;
+    void openHistory(const QString &convId);
+    void setHistoryPosition(const QString &convId, quint64 oldestVisibleTimestamp);
+    void closeHistory(const QString &convId);
+    void setHistoryPrefetchWindow(int pages);
+    void setSyncFilters(const QList<ClientSyncFilter> &filters);
+    void setSyncResponseStates(bool enabled);
+    void setRequestTimeout(const QString &function, int msecs);
+    void setHedgingEnabled(bool enabled);
+    ActivityCounters getActivityCounters() const;
+    DedupCounters getDedupCounters() const;
+    void setImagePreprocessingOptions(const ImagePreprocessingOptions &options);
+    bool setEventStorePath(const QString &path);
+    QList<ClientEvent> getLastEvents(const QString &convId, int count) const;
+    bool setSearchIndexPath(const QString &path);
+    QList<CompletionMatch> autocomplete(const QString &prefix, int limit = COMPLETION_MAX_RESULTS) const;
+    QList<SearchHit> searchEvents(const QString &query, const QString &convId = QString(), int limit = SEARCH_MAX_RESULTS) const;
+    bool saveSnapshot();
 
 public Q_SLOTS:
-    void updateWatermark(QString convId);
+    void updateWatermark(QString convId, quint64 latestReadTimestamp = 0);
     void onAuthenticationDone(QMap<QString, QNetworkCookie> cookies);
     void initDone();
     void onInitChatReply();
     void sendMessageReply();
     void queryPresenceReply();
-    void uploadImageReply();
-    void uploadPerformedReply();
     void syncAllNewEventsReply();
     void setActiveClientReply();
     void setTypingReply();
@@ -85,20 +124,48 @@ Q_SIGNALS:
     void channelRestored();
     void authFailed(AuthenticationStatus status, QString error);
     void clientStateUpdate(ClientStateUpdate &csu);
+    // states arrive one by one through conversationStateSynced, they are
+    // only collected here as well after setSyncResponseStates(true)
     void clientSyncAllNewEventsResponse(ClientSyncAllNewEventsResponse &csanerp);
+    void conversationStateSynced(ClientConversationState &state);
+    void newEvent(ClientEvent &event);
+    void presenceChanged(const QString &chatId);
+    void unreadCountChanged(const QString &convId, int count);
+    void userResolved(const QString &chatId);
+    void entitiesResolved(quint64 requestId);
     void clientGetConversationResponse(quint64 requestId, ClientGetConversationResponse &cgcr);
     void clientSetPresenceResponse(quint64, ClientSetPresenceResponse &csprp);
     void clientQueryPresenceResponse(quint64, ClientQueryPresenceResponse &cqprp);
     void connectionStatusChanged(ConnectionStatus status);
+    void imageUploadProgress(quint64 requestId, qint64 bytesSent, qint64 bytesTotal);
+    // milliseconds from sendImage() until the message with the image was sent
+    void imageDelivered(quint64 requestId, qint64 msecs);
+    void requestFailed(quint64 requestId);
+    void startupProfileReady(const QVariantMap &profile);
+    void historyPrefetched(const QString &convId, ClientConversationState &state);
+    void historyExhausted(const QString &convId);
 
 private Q_SLOTS:
     void onClientBatchUpdate(ClientBatchUpdate &cbu);
     void onGetPVTTokenReply();
     void onChannelRestored(quint64 lastRec);
     void onChannelStatusChanged(Channel::ChannelStatus status);
+    void onHedgeTimeout();
+    void onImageUploaded(quint64 requestId, const QString &conversationId, const QString &imageId);
+    void onImageUploadFailed(quint64 requestId);
+    void onSnapshotTimeout();
+    void onConversationPrefetched();
+    void onHistoryPageReply();
+    void onCatchUpReply();
+    void onSyncReadyRead();
+    void onGapScanReply();
+    void flushPresenceQueries();
+    void flushEntityLookups();
+    void getEntityByIdReply();
+    void flushWatermarks();
+    void flushGapChecks();
 private:
-    void sendImageMessage(const QString &convId, const QString &imgId, const QString &segments);
-    void performImageUpload(const QString &url);
+    void sendImageMessage(quint64 requestId, const QString &convId, const QString &imgId, const QString &segments);
     void getPVTToken();
 
     QString getRequestHeader() const;
@@ -106,8 +173,54 @@ private:
     void followRedirection(const QUrl &url);
 
     QByteArray getAuthHeader() const;
-    QNetworkReply *sendRequest(const QString &function, const QString &json);
+    QNetworkReply *sendRequest(const QString &function, const QString &json,
+                               QNetworkRequest::Priority priority = QNetworkRequest::NormalPriority);
+    void hedgeRequest(QNetworkReply *reply, const QString &function, const QString &json, const char *member);
+    bool takePendingRequest(QNetworkReply *reply, quint64 &requestId);
+    int requestTimeout(const QString &function) const;
+    qint64 hedgeDelay(const QString &function) const;
+    QList<quint64> takeCoalescedRequests(QNetworkReply *reply, quint64 requestId);
     void syncAllNewEvents(quint64 timestamp);
+    void requestSyncPage(quint64 timestamp, int page);
+    bool queueCatchUp(IdHandle convId);
+    void startCatchUps();
+    void decodeSyncStream(QNetworkReply *reply);
+    void applySyncedState(QNetworkReply *reply, ClientConversationState &state);
+    quint64 lastEventTimestamp(IdHandle convId);
+    void checkConversationGap(IdHandle convId, quint64 sortTimestamp);
+    void queueGapCheck(IdHandle convId, quint64 sortTimestamp);
+    void scanForGaps(quint64 since, qint64 endTimestamp);
+    void answerPresenceWaiters(const QList<PresenceWaiter> &waiters, const ClientQueryPresenceResponse &cqprp);
+    bool isPresenceFresh(IdHandle id) const;
+    void updatePresence(const ClientParticipantId &userId, const ClientPresence &presence);
+    bool queueEntityLookup(IdHandle id);
+    void settleEntityWaiters(const QSet<IdHandle> &ids);
+    void indexParticipants(IdHandle convId, const ClientConversation &conversation);
+    void updateParticipantIndex(IdHandle convId, const ClientMembershipChange &change);
+    void seedUnreadState(IdHandle convId, const ClientConversationState &state);
+    void trackUnreadEvent(IdHandle convId, const ClientEvent &event);
+    void markConversationRead(IdHandle convId, quint64 timestamp);
+    void notifyUnreadCount(IdHandle convId, int before);
+    void deliverEvents(const ClientConversationState &state);
+    void deliverEvent(const ClientEvent &event);
+    void applyStateUpdate(const ClientStateUpdate &update);
+    void mergeConversationState(const ClientConversationState &state);
+    void addConversationEvent(const ClientEvent &event);
+    ClientConversationState *detachConversation(const ClientConversationId &id);
+    void prefetchConversation(IdHandle convId);
+    void fillHistoryWindow(IdHandle convId);
+    bool loadSnapshot();
+    bool loadInitCache();
+    void saveInitCache();
+    void discardInitCache();
+    void startPhase(BootstrapPhase phase);
+    void finishPhase(BootstrapPhase phase);
+    void skipPhase(BootstrapPhase phase);
+    void startReadyPhases();
+    void resetBootstrap(BootstrapPhase from = BOOTSTRAP_AUTHENTICATION);
+    QVariantMap startupProfile() const;
+    void startChannel();
+    void decodeInitData();
 
     bool mAppPaused;
     quint64 mCurrentRequestId;
@@ -116,7 +229,6 @@ private:
     QNetworkAccessManager mNetworkAccessManager;
     quint64 mNeedSyncTS;
     QDateTime mLastSetActive;
-    QList<OutgoingImage> mOutgoingImages;
     QString mCookiePath;
     Authenticator *mAuthenticator;
     QNetworkCookieJar mCookieJar;
@@ -124,9 +236,61 @@ private:
     QString mApiKey, mHeaderDate, mHeaderVersion, mHeaderId, mChannelPath, mClid, mChannelEcParam, mChannelPropParam, mSyncTimestamp;
     ClientEntity mMyself;
     Channel *mChannel;
-    QMap<QString, ClientEntity> mUsers;
-    QMap<QString, ClientConversationState> mConversations;
+    QHash<IdHandle, ClientEntityPtr> mUsers;
+    mutable ConversationCache mConversations;
     QMap<QNetworkReply*, quint64> mPendingRequests;
+    bool mHedgingEnabled;
+    QMap<QString, int> mRequestTimeouts;
+    QMap<QString, QList<qint64> > mLatencySamples;
+    QMap<QNetworkReply*, HedgedRequest> mHedgeCandidates;
+    QMap<QNetworkReply*, QNetworkReply*> mHedgedReplies;
+    QMap<QString, quint64> mInFlightRequests;
+    QMap<quint64, QList<quint64> > mCoalescedRequests;
+    QList<PresenceWaiter> mPresenceWaiters;
+    QMap<quint64, QList<PresenceWaiter> > mPresenceBatches;
+    QTimer mPresenceBatchTimer;
+    QHash<IdHandle, PresenceEntry> mPresence;
+    QSet<IdHandle> mQueuedEntities;
+    QSet<IdHandle> mEntitiesInFlight;
+    QHash<IdHandle, qint64> mUnresolvedEntities;
+    QList<EntityWaiter> mEntityWaiters;
+    QTimer mEntityBatchTimer;
+    QHash<IdHandle, ConversationActivity> mConversationActivity;
+    QHash<IdHandle, quint64> mPendingWatermarks;
+    QTimer mWatermarkTimer;
+    ActivityCounters mActivityCounters;
+    ImageUploader *mImageUploader;
+    QMap<quint64, qint64> mImagesSentAt;
+    EventStore *mEventStore;
+    SearchIndex *mSearchIndex;
+    EventDeduplicator mDeduplicator;
+    quint64 mLastSyncTimestamp;
+    QTimer mSnapshotTimer;
+    bool mUsingCachedInit;
+    QElapsedTimer mConnectTimer;
+    BootstrapPhaseState mBootstrapPhases[BOOTSTRAP_PHASE_COUNT];
+    QString mPvtToken;
+    QHash<QByteArray, QVariantList> mInitData;
+    QSet<IdHandle> mPrefetchingConversations;
+    QHash<IdHandle, HistoryCursor> mHistoryCursors;
+    int mHistoryPrefetchWindow;
+    QList<ClientSyncFilter> mSyncFilters;
+    QList<IdHandle> mCatchUpQueue;
+    QHash<IdHandle, int> mCatchUpAttempts;
+    QHash<IdHandle, quint64> mPendingGapChecks;
+    QTimer mGapCheckTimer;
+    int mCatchUpsInFlight;
+    QMap<QNetworkReply*, SyncStreamDecoder*> mSyncDecoders;
+    QMap<QNetworkReply*, QList<ClientConversationState> > mSyncDeferredStates;
+    QMap<QNetworkReply*, QList<ClientConversationState> > mSyncStates;
+    bool mSyncResponseStates;
+    QScriptEngine mSyncScriptEngine;
+    QMap<QNetworkReply*, int> mSyncStateCounts;
+    QHash<IdHandle, quint64> mLastEventTimestamps;
+    QHash<IdHandle, UnreadState> mUnread;
+    QHash<IdHandle, QHash<IdHandle, ClientEntityPtr> > mParticipants;
+    CompletionIndex mCompletions;
+    int mTotalUnread;
 
 };
 
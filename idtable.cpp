@@ -0,0 +1,123 @@
+/**
+ * libhangish
+ * Copyright (C) 2015 Tiago Salem Herrmann
+ * Copyright (C) 2015 Daniele Rogora
+ *
+ * This file is part of libhangish.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QHash>
+#include <QReadWriteLock>
+#include <QVector>
+
+#include "idtable.h"
+
+struct IdTableData {
+    IdTableData() { ids.append(QByteArray()); }
+    QReadWriteLock lock;
+    QHash<QByteArray, IdHandle> handles;
+    QVector<QByteArray> ids;
+};
+
+Q_GLOBAL_STATIC(IdTableData, idTable)
+
+static IdHandle findBytes(const char *id, int size)
+{
+    if (size == 0) {
+        return 0;
+    }
+    IdTableData *table = idTable();
+    QReadLocker locker(&table->lock);
+    return table->handles.value(QByteArray::fromRawData(id, size));
+}
+
+IdHandle IdTable::intern(const char *id, int size)
+{
+    IdHandle handle = findBytes(id, size);
+    if (handle || size == 0) {
+        return handle;
+    }
+
+    IdTableData *table = idTable();
+    QWriteLocker locker(&table->lock);
+    // another thread may have added it in the meantime
+    QByteArray key(id, size);
+    handle = table->handles.value(key);
+    if (!handle) {
+        handle = table->ids.size();
+        table->ids.append(key);
+        table->handles.insert(key, handle);
+    }
+    return handle;
+}
+
+IdHandle IdTable::intern(const std::string &id)
+{
+    return intern(id.data(), id.size());
+}
+
+IdHandle IdTable::intern(const QString &id)
+{
+    QByteArray utf8 = id.toUtf8();
+    return intern(utf8.constData(), utf8.size());
+}
+
+IdHandle IdTable::find(const std::string &id)
+{
+    return findBytes(id.data(), id.size());
+}
+
+IdHandle IdTable::find(const QString &id)
+{
+    QByteArray utf8 = id.toUtf8();
+    return findBytes(utf8.constData(), utf8.size());
+}
+
+QByteArray IdTable::toUtf8(IdHandle handle)
+{
+    IdTableData *table = idTable();
+    QReadLocker locker(&table->lock);
+    return table->ids.value(handle);
+}
+
+QString IdTable::toString(IdHandle handle)
+{
+    return QString::fromUtf8(toUtf8(handle));
+}
+
+std::string IdTable::toStdString(IdHandle handle)
+{
+    QByteArray utf8 = toUtf8(handle);
+    return std::string(utf8.constData(), utf8.size());
+}
+
+int IdTable::size()
+{
+    IdTableData *table = idTable();
+    QReadLocker locker(&table->lock);
+    return table->ids.size() - 1;
+}
+
+qint64 IdTable::bytes()
+{
+    IdTableData *table = idTable();
+    QReadLocker locker(&table->lock);
+    qint64 bytes = table->ids.capacity() * sizeof(QByteArray);
+    Q_FOREACH (const QByteArray &id, table->ids) {
+        bytes += id.capacity();
+    }
+    return bytes + table->handles.size() * (sizeof(QByteArray) + sizeof(IdHandle));
+}
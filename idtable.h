@@ -0,0 +1,75 @@
+/**
+ * libhangish
+ * Copyright (C) 2015 Tiago Salem Herrmann
+ * Copyright (C) 2015 Daniele Rogora
+ *
+ * This file is part of libhangish.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IDTABLE_H
+#define IDTABLE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+
+#include <string>
+
+#include "types.h"
+
+/*
+ * Process wide table of interned chat, gaia and conversation ids. Every
+ * distinct id is stored once and referred to by a 32 bit handle, so that
+ * indexes can be keyed and compared by integer. Handle 0 is the empty id.
+ * All methods are thread safe.
+ */
+class IdTable
+{
+
+public:
+    static IdHandle intern(const char *id, int size);
+    static IdHandle intern(const std::string &id);
+    static IdHandle intern(const QString &id);
+    static IdHandle find(const std::string &id);
+    static IdHandle find(const QString &id);
+    static QByteArray toUtf8(IdHandle handle);
+    static QString toString(IdHandle handle);
+    static std::string toStdString(IdHandle handle);
+    static int size();
+    static qint64 bytes();
+};
+
+/*
+ * Java style read only iteration over a table keyed by handles. The table
+ * is shared, not copied, and keys come out as strings like everywhere
+ * else in the public API.
+ */
+template <class T>
+class IdHashIterator
+{
+
+public:
+    IdHashIterator(const QHash<IdHandle, T> &hash) : mIterator(hash) {}
+    bool hasNext() const { return mIterator.hasNext(); }
+    void next() { mIterator.next(); }
+    QString key() const { return IdTable::toString(mIterator.key()); }
+    const T &value() const { return mIterator.value(); }
+
+private:
+    QHashIterator<IdHandle, T> mIterator;
+};
+
+#endif // IDTABLE_H
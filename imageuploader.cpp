@@ -0,0 +1,414 @@
+/**
+ * libhangish
+ * Copyright (C) 2015 Tiago Salem Herrmann
+ * Copyright (C) 2015 Daniele Rogora
+ *
+ * This file is part of libhangish.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QDateTime>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFutureWatcher>
+#include <QImageReader>
+#include <QImageWriter>
+#include <QTemporaryFile>
+#include <QTimer>
+#include <QtConcurrentRun>
+
+#include "imageuploader.h"
+
+ImageUploader::ImageUploader(QMap<QString, QNetworkCookie> &cookies) :
+    mSessionCookies(&cookies),
+    mMaxParallelUploads(IMAGE_UPLOAD_MAX_PARALLEL)
+{
+}
+
+void ImageUploader::setMaxParallelUploads(int maxParallelUploads)
+{
+    mMaxParallelUploads = qMax(1, maxParallelUploads);
+    startNext();
+}
+
+void ImageUploader::setPreprocessingOptions(const ImagePreprocessingOptions &options)
+{
+    mPreprocessingOptions = options;
+}
+
+void ImageUploader::upload(quint64 requestId, const QString &conversationId, const QString &filename)
+{
+    OutgoingImage oi;
+    oi.requestId = requestId;
+    oi.conversationId = conversationId;
+    oi.filename = filename;
+    oi.size = QFile(filename).size();
+
+    if (!mPreprocessingOptions.enabled || oi.size < mPreprocessingOptions.minFileSize) {
+        enqueue(oi);
+        return;
+    }
+
+    // decoding and re-encoding is too slow for the main thread
+    mPreprocessingImages[requestId] = oi;
+    QFutureWatcher<QString> *watcher = new QFutureWatcher<QString>(this);
+    watcher->setProperty("requestId", requestId);
+    QObject::connect(watcher, SIGNAL(finished()), this, SLOT(preprocessingFinished()));
+    watcher->setFuture(QtConcurrent::run(&ImageUploader::preprocess, filename, mPreprocessingOptions));
+}
+
+QString ImageUploader::preprocess(const QString &filename, const ImagePreprocessingOptions &options)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    QImageReader reader(filename);
+    reader.setAutoTransform(true);
+    if (reader.supportsAnimation() && reader.imageCount() != 1) {
+        // re-encoding would keep a single frame
+        return filename;
+    }
+    QSize size = reader.size();
+    bool resize = size.isValid() && (size.width() > options.maxDimension || size.height() > options.maxDimension);
+    if (resize) {
+        // let the decoder scale, which is much cheaper for JPEG
+        reader.setScaledSize(size.scaled(options.maxDimension, options.maxDimension, Qt::KeepAspectRatio));
+    }
+    QByteArray format = reader.format();
+    QImage image = reader.read();
+    if (image.isNull()) {
+        qDebug() << "Could not decode image" << filename << reader.errorString();
+        return filename;
+    }
+    // JPEG would flatten transparency and smear GIF art, those stay lossless
+    bool lossless = image.hasAlphaChannel() || format == "gif";
+    image = image.convertToFormat(image.hasAlphaChannel() ? QImage::Format_ARGB32 : QImage::Format_RGB32);
+    // only the pixels, the text keys read from the original would be written back
+    image = QImage(image.constBits(), image.width(), image.height(), image.bytesPerLine(), image.format()).copy();
+
+    // created exclusively and only readable by us, unlike a predictable name
+    QTemporaryFile output(QDir::temp().filePath(lossless ? "hangish-upload-XXXXXX.png" : "hangish-upload-XXXXXX.jpg"));
+    output.setAutoRemove(false);
+    if (!output.open()) {
+        qDebug() << "Could not create temporary file" << output.errorString();
+        return filename;
+    }
+    QString outputPath = output.fileName();
+
+    // QImageWriter does not carry over EXIF, so nothing of the original is left
+    QImageWriter writer(&output, lossless ? "png" : "jpg");
+    if (!lossless) {
+        writer.setQuality(options.quality);
+    }
+    bool written = writer.write(image);
+    output.close();
+    if (!written) {
+        qDebug() << "Could not re-encode image" << writer.errorString();
+        QFile::remove(outputPath);
+        return filename;
+    }
+
+    qint64 originalSize = QFileInfo(filename).size();
+    qint64 processedSize = QFileInfo(outputPath).size();
+    qDebug() << "Preprocessed" << filename << originalSize << "->" << processedSize << "bytes in" << timer.elapsed() << "ms";
+    // kept even when larger, the original still has its metadata
+    return outputPath;
+}
+
+void ImageUploader::preprocessingFinished()
+{
+    QFutureWatcher<QString> *watcher = static_cast<QFutureWatcher<QString> *>(sender());
+    quint64 requestId = watcher->property("requestId").toULongLong();
+    QString processedFilename = watcher->result();
+    watcher->deleteLater();
+
+    OutgoingImage oi = mPreprocessingImages.take(requestId);
+    if (processedFilename != oi.filename) {
+        oi.filename = processedFilename;
+        oi.size = QFile(processedFilename).size();
+        oi.temporary = true;
+    }
+    enqueue(oi);
+}
+
+void ImageUploader::enqueue(const OutgoingImage &image)
+{
+    mQueuedImages.append(image);
+    startNext();
+}
+
+void ImageUploader::startNext()
+{
+    while (mActiveImages.size() < mMaxParallelUploads && !mQueuedImages.isEmpty()) {
+        OutgoingImage oi = mQueuedImages.takeFirst();
+        mActiveImages[oi.requestId] = oi;
+        createSession(oi);
+    }
+}
+
+QNetworkRequest ImageUploader::uploadRequest(const QUrl &url) const
+{
+    QNetworkRequest req(url);
+    req.setRawHeader("User-Agent", USER_AGENT);
+    req.setRawHeader("X-GUploader-Client-Info", "mechanism=scotty xhr resumable; clientVersion=82480166");
+    req.setRawHeader("content-type", "application/x-www-form-urlencoded;charset=utf-8");
+
+    QList<QNetworkCookie> reqCookies;
+    Q_FOREACH (QNetworkCookie cookie, *mSessionCookies) {
+        if (cookie.name()=="SAPISID" || cookie.name()=="SSID" || cookie.name()=="HSID" || cookie.name()=="APISID" || cookie.name()=="SID") {
+            reqCookies.append(cookie);
+        }
+    }
+    req.setHeader(QNetworkRequest::CookieHeader, QVariant::fromValue(reqCookies));
+    return req;
+}
+
+void ImageUploader::createSession(const OutgoingImage &image)
+{
+    QString filename = image.filename.right(image.filename.size()-image.filename.lastIndexOf("/")-1);
+
+    QJsonObject emptyObj;
+    QJsonArray jarr;
+    QJsonObject j1, jj1;
+    j1["name"] = QJsonValue(QString("file"));
+    j1["filename"] = QJsonValue(filename);
+    j1["put"] = emptyObj;
+    j1["size"] =  QJsonValue(image.size);
+    jj1["external"] = j1;
+    jarr.append(jj1);
+
+    qint64 time = QDateTime::currentMSecsSinceEpoch();
+    QList<QPair<QString, QString> > inlined;
+    inlined << qMakePair(QString("album_mode"), QString("temporary"))
+            << qMakePair(QString("title"), filename)
+            << qMakePair(QString("addtime"), QString::number(time))
+            << qMakePair(QString("batchid"), QString::number(time))
+            << qMakePair(QString("album_name"), QString("hangish"))
+            << qMakePair(QString("album_abs_position"), QString("0"))
+            << qMakePair(QString("client"), QString("hangouts"));
+    for (int i = 0; i < inlined.size(); i++) {
+        QJsonObject j, jj;
+        j["name"] = QJsonValue(inlined.at(i).first);
+        j["content"] = QJsonValue(inlined.at(i).second);
+        j["contentType"] = QJsonValue(QString("text/plain"));
+        jj["inlined"] = j;
+        jarr.append(jj);
+    }
+
+    QJsonObject jjson;
+    jjson["fields"] = jarr;
+
+    QJsonObject json;
+    json["createSessionRequest"] = jjson;
+    json["protocolVersion"] = QJsonValue(QString("0.8"));
+
+    qDebug() << "Sending request for up image" << image.requestId;
+    QByteArray body = QJsonDocument(json).toJson();
+
+    QNetworkRequest req = uploadRequest(QUrl(IMAGE_UPLOAD_URL));
+    req.setRawHeader("Content-Length", QByteArray::number(body.size()));
+    QNetworkReply *reply = mNetworkAccessManager.post(req, body);
+    mReplies[reply] = image.requestId;
+    QObject::connect(reply, SIGNAL(finished()), this, SLOT(createSessionReply()));
+}
+
+void ImageUploader::createSessionReply()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
+    quint64 requestId = mReplies.take(reply);
+    reply->deleteLater();
+    if (!mActiveImages.contains(requestId)) {
+        return;
+    }
+
+    if (reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt()!=200) {
+        qDebug() << "Problem uploading " << reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        fail(requestId);
+        return;
+    }
+
+    OutgoingImage &image = mActiveImages[requestId];
+    image.uploadUrl = reply->header(QNetworkRequest::LocationHeader).toString();
+    qDebug() << "Upload ready" << image.uploadUrl;
+    sendChunk(image);
+}
+
+void ImageUploader::sendChunk(OutgoingImage &image)
+{
+    // only one chunk of the file is kept in memory at a time
+    QFile inFile(image.filename);
+    if (!inFile.open(QIODevice::ReadOnly) || !inFile.seek(image.offset)) {
+        qDebug() << "File not found";
+        fail(image.requestId);
+        return;
+    }
+    QByteArray chunk = inFile.read(IMAGE_UPLOAD_CHUNK_SIZE);
+    inFile.close();
+    bool lastChunk = image.offset + chunk.size() >= image.size;
+
+    QNetworkRequest req = uploadRequest(QUrl(image.uploadUrl));
+    req.setRawHeader("Content-Length", QByteArray::number(chunk.size()));
+    req.setRawHeader("X-Goog-Upload-Command", lastChunk ? "upload, finalize" : "upload");
+    req.setRawHeader("X-Goog-Upload-Offset", QByteArray::number(image.offset));
+    QNetworkReply *reply = mNetworkAccessManager.post(req, chunk);
+    reply->setProperty("chunkSize", chunk.size());
+    mReplies[reply] = image.requestId;
+    QObject::connect(reply, SIGNAL(uploadProgress(qint64,qint64)), this, SLOT(chunkProgress(qint64,qint64)));
+    QObject::connect(reply, SIGNAL(finished()), this, SLOT(chunkReply()));
+}
+
+void ImageUploader::chunkProgress(qint64 bytesSent, qint64 bytesTotal)
+{
+    Q_UNUSED(bytesTotal)
+    QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
+    quint64 requestId = mReplies.value(reply);
+    if (!mActiveImages.contains(requestId)) {
+        return;
+    }
+    const OutgoingImage &image = mActiveImages[requestId];
+    Q_EMIT uploadProgress(requestId, image.offset + bytesSent, image.size);
+}
+
+void ImageUploader::chunkReply()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
+    quint64 requestId = mReplies.take(reply);
+    reply->deleteLater();
+    if (!mActiveImages.contains(requestId)) {
+        return;
+    }
+    OutgoingImage &image = mActiveImages[requestId];
+
+    int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if (reply->error() != QNetworkReply::NoError || status != 200) {
+        qDebug() << "Problem uploading chunk at" << image.offset << status;
+        if (status >= 400 && status < 500) {
+            fail(requestId);
+        } else {
+            retry(image);
+        }
+        return;
+    }
+
+    image.offset += reply->property("chunkSize").toLongLong();
+    image.retries = 0;
+    Q_EMIT uploadProgress(requestId, image.offset, image.size);
+
+    if (image.offset < image.size) {
+        sendChunk(image);
+    } else {
+        finish(image, reply->readAll());
+    }
+}
+
+void ImageUploader::retry(OutgoingImage &image)
+{
+    if (++image.retries > IMAGE_UPLOAD_MAX_RETRIES) {
+        fail(image.requestId);
+        return;
+    }
+    QTimer *retryTimer = new QTimer(this);
+    retryTimer->setSingleShot(true);
+    retryTimer->setProperty("requestId", image.requestId);
+    QObject::connect(retryTimer, SIGNAL(timeout()), this, SLOT(onRetryTimeout()));
+    retryTimer->start(1000 * (1 << (image.retries - 1)));
+}
+
+void ImageUploader::onRetryTimeout()
+{
+    quint64 requestId = sender()->property("requestId").toULongLong();
+    sender()->deleteLater();
+    if (mActiveImages.contains(requestId)) {
+        queryOffset(mActiveImages[requestId]);
+    }
+}
+
+void ImageUploader::queryOffset(const OutgoingImage &image)
+{
+    // ask the server how much it got before resuming
+    QNetworkRequest req = uploadRequest(QUrl(image.uploadUrl));
+    req.setRawHeader("Content-Length", "0");
+    req.setRawHeader("X-Goog-Upload-Command", "query");
+    QNetworkReply *reply = mNetworkAccessManager.post(req, QByteArray());
+    mReplies[reply] = image.requestId;
+    QObject::connect(reply, SIGNAL(finished()), this, SLOT(queryOffsetReply()));
+}
+
+void ImageUploader::queryOffsetReply()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
+    quint64 requestId = mReplies.take(reply);
+    reply->deleteLater();
+    if (!mActiveImages.contains(requestId)) {
+        return;
+    }
+    OutgoingImage &image = mActiveImages[requestId];
+
+    if (reply->error() != QNetworkReply::NoError || reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() != 200) {
+        retry(image);
+        return;
+    }
+
+    if (reply->rawHeader("X-Goog-Upload-Status") == "final") {
+        finish(image, reply->readAll());
+        return;
+    }
+    image.offset = reply->rawHeader("X-Goog-Upload-Size-Received").toLongLong();
+    qDebug() << "Resuming upload" << requestId << "at" << image.offset;
+    sendChunk(image);
+}
+
+void ImageUploader::finish(OutgoingImage &image, const QByteArray &reply)
+{
+    QJsonDocument doc = QJsonDocument::fromJson(reply);
+    QJsonObject obj = doc.object().take("sessionStatus").toObject();
+    QString state = obj.take("state").toString();
+    if (state != "FINALIZED") {
+        qDebug() << "Upload not finalized" << state;
+        fail(image.requestId);
+        return;
+    }
+
+    //Retrieve the id of the image
+    QString imgId = obj.take("additionalInfo").toObject()
+                    .take("uploader_service.GoogleRupioAdditionalInfo").toObject()
+                    .take("completionInfo").toObject()
+                    .take("customerSpecificInfo").toObject()
+                    .take("photoid").toString();
+    qDebug() << "Uploaded img" << imgId;
+
+    OutgoingImage done = mActiveImages.take(image.requestId);
+    if (done.temporary) {
+        QFile::remove(done.filename);
+    }
+    Q_EMIT uploadFinished(done.requestId, done.conversationId, imgId);
+    startNext();
+}
+
+void ImageUploader::fail(quint64 requestId)
+{
+    OutgoingImage failed = mActiveImages.take(requestId);
+    if (failed.temporary) {
+        QFile::remove(failed.filename);
+    }
+    Q_EMIT uploadFailed(requestId);
+    startNext();
+}
@@ -0,0 +1,77 @@
+/**
+ * libhangish
+ * Copyright (C) 2015 Tiago Salem Herrmann
+ * Copyright (C) 2015 Daniele Rogora
+ *
+ * This file is part of libhangish.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IMAGEUPLOADER_H
+#define IMAGEUPLOADER_H
+
+#include <QObject>
+#include <QNetworkAccessManager>
+#include <QNetworkCookie>
+#include <QNetworkReply>
+
+#include "types.h"
+
+class ImageUploader : public QObject
+{
+    Q_OBJECT
+
+public:
+    ImageUploader(QMap<QString, QNetworkCookie> &cookies);
+    void upload(quint64 requestId, const QString &conversationId, const QString &filename);
+    void setMaxParallelUploads(int maxParallelUploads);
+    void setPreprocessingOptions(const ImagePreprocessingOptions &options);
+    static QString preprocess(const QString &filename, const ImagePreprocessingOptions &options);
+
+Q_SIGNALS:
+    void uploadProgress(quint64 requestId, qint64 bytesSent, qint64 bytesTotal);
+    void uploadFinished(quint64 requestId, const QString &conversationId, const QString &imageId);
+    void uploadFailed(quint64 requestId);
+
+private Q_SLOTS:
+    void createSessionReply();
+    void chunkProgress(qint64 bytesSent, qint64 bytesTotal);
+    void chunkReply();
+    void queryOffsetReply();
+    void onRetryTimeout();
+    void preprocessingFinished();
+
+private:
+    void enqueue(const OutgoingImage &image);
+    void startNext();
+    void createSession(const OutgoingImage &image);
+    void sendChunk(OutgoingImage &image);
+    void queryOffset(const OutgoingImage &image);
+    void retry(OutgoingImage &image);
+    void finish(OutgoingImage &image, const QByteArray &reply);
+    void fail(quint64 requestId);
+    QNetworkRequest uploadRequest(const QUrl &url) const;
+
+    QNetworkAccessManager mNetworkAccessManager;
+    QMap<QString, QNetworkCookie> *mSessionCookies;
+    QList<OutgoingImage> mQueuedImages;
+    QMap<quint64, OutgoingImage> mActiveImages;
+    QMap<QNetworkReply*, quint64> mReplies;
+    QMap<quint64, OutgoingImage> mPreprocessingImages;
+    int mMaxParallelUploads;
+    ImagePreprocessingOptions mPreprocessingOptions;
+};
+
+#endif // IMAGEUPLOADER_H
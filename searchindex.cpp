@@ -0,0 +1,652 @@
+/**
+ * libhangish
+ * Copyright (C) 2015 Tiago Salem Herrmann
+ * Copyright (C) 2015 Daniele Rogora
+ *
+ * This file is part of libhangish.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QPair>
+#include <QSaveFile>
+#include <QTextBoundaryFinder>
+#include <QtConcurrentRun>
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <string.h>
+
+#include "eventstore.h"
+#include "searchindex.h"
+
+#define RECORD_MAGIC 0x58444953
+#define FILE_MAGIC 0x46444953
+#define FILE_VERSION 1
+
+static quint64 eventHash(const QByteArray &eventId)
+{
+    // FNV-1a, only used to tell event ids apart
+    quint64 hash = Q_UINT64_C(14695981039346656037);
+    for (int i = 0; i < eventId.size(); i++) {
+        hash ^= (uchar)eventId.at(i);
+        hash *= Q_UINT64_C(1099511628211);
+    }
+    return hash;
+}
+
+static int compareTerms(const QByteArray &a, const QByteArray &b)
+{
+    // the byte order QByteArray and the dictionary are sorted by
+    int result = memcmp(a.constData(), b.constData(), qMin(a.size(), b.size()));
+    return result ? result : a.size() - b.size();
+}
+
+SearchIndex::SearchIndex(const QString &path) :
+    mBaseFile(QDir(path).filePath("index.dat")),
+    mPendingFile(QDir(path).filePath("pending.log")),
+    mBase(NULL),
+    mBaseSize(0),
+    mRebuild(NULL)
+{
+}
+
+SearchIndex::~SearchIndex()
+{
+    if (mRebuild) {
+        mRebuild->waitForFinished();
+    }
+    unmapBase();
+    mPendingFile.close();
+}
+
+bool SearchIndex::open(const QString &eventStorePath)
+{
+    QDir dir(QFileInfo(mBaseFile).absolutePath());
+    if (!dir.mkpath(".") || !mPendingFile.open(QIODevice::ReadWrite)) {
+        qDebug() << "Could not open search index" << dir.path();
+        return false;
+    }
+    bool hasBase = mapBase();
+
+    // merges keep this log under SEARCH_MERGE_EVENTS records
+    qint64 size = mPendingFile.size();
+    qint64 offset = 0;
+    const uchar *data = size ? mPendingFile.map(0, size) : NULL;
+    while (data && offset + (qint64)sizeof(RecordHeader) <= size) {
+        RecordHeader header;
+        memcpy(&header, data + offset, sizeof(RecordHeader));
+        if (header.magic != RECORD_MAGIC) {
+            break;
+        }
+        qint64 bodyLength = header.conversationIdLength + header.eventIdLength + header.termsLength;
+        if (offset + (qint64)sizeof(RecordHeader) + bodyLength > size) {
+            break;
+        }
+        const char *body = reinterpret_cast<const char *>(data + offset + sizeof(RecordHeader));
+        if (qChecksum(body, bodyLength) != header.checksum) {
+            break;
+        }
+
+        PendingDocument document;
+        document.conversationId = QByteArray(body, header.conversationIdLength);
+        document.eventId = QByteArray(body + header.conversationIdLength, header.eventIdLength);
+        document.timestamp = header.timestamp;
+        document.hash = eventHash(document.eventId);
+        document.terms = QByteArray(body + header.conversationIdLength + header.eventIdLength, header.termsLength).split('\0');
+        if (!mPendingHashes.contains(document.hash) && !(mBase && baseContains(mBase, document.hash))) {
+            mPending.append(document);
+            mPendingHashes.insert(document.hash);
+        }
+        offset += sizeof(RecordHeader) + bodyLength;
+    }
+    if (data) {
+        mPendingFile.unmap(const_cast<uchar *>(data));
+    }
+    if (offset < size) {
+        // torn write at the tail, drop it so appends stay readable
+        mPendingFile.resize(offset);
+    }
+    mPendingFile.seek(offset);
+
+    if (!hasBase && !eventStorePath.isEmpty()) {
+        // first open, index what the event store already has
+        mRebuild = new QFutureWatcher<bool>(this);
+        QObject::connect(mRebuild, SIGNAL(finished()), this, SLOT(onRebuildFinished()));
+        mRebuild->setFuture(QtConcurrent::run(&SearchIndex::backfill, mBaseFile.fileName(), eventStorePath));
+    } else if (mPending.size() >= SEARCH_MERGE_EVENTS) {
+        startMerge();
+    }
+    qDebug() << "Search index opened with" << (mBase ? reinterpret_cast<const FileHeader *>(mBase)->documentCount : 0)
+             << "events on disk and" << mPending.size() << "pending";
+    return true;
+}
+
+QStringList SearchIndex::tokenize(const QString &text, QList<bool> *prefixes)
+{
+    QStringList terms;
+    QTextBoundaryFinder finder(QTextBoundaryFinder::Word, text);
+    int start = -1;
+    for (int pos = finder.position(); pos != -1; pos = finder.toNextBoundary()) {
+        QTextBoundaryFinder::BoundaryReasons reasons = finder.boundaryReasons();
+        if (start >= 0 && (reasons & QTextBoundaryFinder::EndOfItem)) {
+            terms.append(text.mid(start, pos - start).normalized(QString::NormalizationForm_KC).toCaseFolded());
+            if (prefixes) {
+                prefixes->append(pos < text.size() && text.at(pos) == QLatin1Char('*'));
+            }
+            start = -1;
+        }
+        if (reasons & QTextBoundaryFinder::StartOfItem) {
+            start = pos;
+        }
+    }
+    return terms;
+}
+
+bool SearchIndex::makeDocument(const ClientEvent &event, PendingDocument &document)
+{
+    if (!event.has_chatmessage() || event.eventid().empty()) {
+        return false;
+    }
+    QString text;
+    const ClientMessageContent &content = event.chatmessage().messagecontent();
+    for (int i = 0; i < content.segment_size(); i++) {
+        text += QString::fromStdString(content.segment(i).text());
+        text += QLatin1Char(' ');
+    }
+    QStringList words = tokenize(text);
+    words.removeDuplicates();
+    Q_FOREACH (const QString &word, words) {
+        document.terms.append(word.toUtf8());
+    }
+    if (document.terms.isEmpty()) {
+        return false;
+    }
+    document.conversationId = QByteArray(event.conversationid().id().data(), event.conversationid().id().size());
+    document.eventId = QByteArray(event.eventid().data(), event.eventid().size());
+    document.timestamp = event.timestamp();
+    document.hash = eventHash(document.eventId);
+    return true;
+}
+
+bool SearchIndex::add(const ClientEvent &event)
+{
+    PendingDocument document;
+    if (!mPendingFile.isOpen() || !makeDocument(event, document)) {
+        return false;
+    }
+    if (mPendingHashes.contains(document.hash) || (mBase && baseContains(mBase, document.hash))) {
+        return false;
+    }
+    if (!writePending(document)) {
+        return false;
+    }
+    mPending.append(document);
+    mPendingHashes.insert(document.hash);
+    if (mPending.size() >= SEARCH_MERGE_EVENTS) {
+        startMerge();
+    }
+    return true;
+}
+
+bool SearchIndex::writePending(const PendingDocument &document)
+{
+    QByteArray terms;
+    for (int i = 0; i < document.terms.size(); i++) {
+        if (i) {
+            terms += '\0';
+        }
+        terms += document.terms.at(i);
+    }
+    QByteArray body = document.conversationId + document.eventId + terms;
+
+    RecordHeader header;
+    header.magic = RECORD_MAGIC;
+    header.termsLength = terms.size();
+    header.timestamp = document.timestamp;
+    header.conversationIdLength = document.conversationId.size();
+    header.eventIdLength = document.eventId.size();
+    header.checksum = qChecksum(body.constData(), body.size());
+    header.reserved = 0;
+    if (mPendingFile.write(reinterpret_cast<const char *>(&header), sizeof(RecordHeader)) != sizeof(RecordHeader) ||
+        mPendingFile.write(body) != body.size()) {
+        qDebug() << "Could not write to search index" << mPendingFile.errorString();
+        return false;
+    }
+    mPendingFile.flush();
+    return true;
+}
+
+void SearchIndex::rewritePending()
+{
+    QString fileName = mPendingFile.fileName();
+    mPendingFile.close();
+    QSaveFile pending(fileName);
+    if (pending.open(QIODevice::WriteOnly)) {
+        pending.commit();
+    }
+    if (!mPendingFile.open(QIODevice::ReadWrite)) {
+        qDebug() << "Could not reopen search index log" << mPendingFile.errorString();
+        return;
+    }
+    Q_FOREACH (const PendingDocument &document, mPending) {
+        writePending(document);
+    }
+}
+
+void SearchIndex::startMerge()
+{
+    if (mRebuild) {
+        return;
+    }
+    mRebuild = new QFutureWatcher<bool>(this);
+    QObject::connect(mRebuild, SIGNAL(finished()), this, SLOT(onRebuildFinished()));
+    mRebuild->setFuture(QtConcurrent::run(&SearchIndex::merge, mBaseFile.fileName(), mBaseFile.fileName(), mPending));
+}
+
+void SearchIndex::onRebuildFinished()
+{
+    bool written = mRebuild->result();
+    mRebuild->deleteLater();
+    mRebuild = NULL;
+    if (!written) {
+        qDebug() << "Could not write search index" << mBaseFile.fileName();
+        return;
+    }
+
+    unmapBase();
+    mapBase();
+    // whatever made it to disk leaves the pending log
+    QList<PendingDocument> pending;
+    Q_FOREACH (const PendingDocument &document, mPending) {
+        if (mBase && baseContains(mBase, document.hash)) {
+            mPendingHashes.remove(document.hash);
+        } else {
+            pending.append(document);
+        }
+    }
+    mPending = pending;
+    rewritePending();
+    qDebug() << "Search index written with" << (mBase ? reinterpret_cast<const FileHeader *>(mBase)->documentCount : 0)
+             << "events," << mPending.size() << "still pending";
+    if (mPending.size() >= SEARCH_MERGE_EVENTS) {
+        startMerge();
+    }
+}
+
+bool SearchIndex::mapBase()
+{
+    if (!mBaseFile.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    qint64 size = mBaseFile.size();
+    uchar *data = size >= (qint64)sizeof(FileHeader) ? mBaseFile.map(0, size) : NULL;
+    if (!data || !validBase(data, size)) {
+        qDebug() << "Ignoring invalid search index" << mBaseFile.fileName();
+        if (data) {
+            mBaseFile.unmap(data);
+        }
+        mBaseFile.close();
+        return false;
+    }
+    mBase = data;
+    mBaseSize = size;
+    return true;
+}
+
+void SearchIndex::unmapBase()
+{
+    if (mBase) {
+        mBaseFile.unmap(const_cast<uchar *>(mBase));
+        mBase = NULL;
+        mBaseSize = 0;
+    }
+    mBaseFile.close();
+}
+
+bool SearchIndex::validBase(const uchar *base, qint64 size)
+{
+    if (size < (qint64)sizeof(FileHeader)) {
+        return false;
+    }
+    const FileHeader *header = reinterpret_cast<const FileHeader *>(base);
+    if (header->magic != FILE_MAGIC || header->version != FILE_VERSION) {
+        return false;
+    }
+    return header->documentsOffset >= sizeof(FileHeader) &&
+           header->documentsOffset + (quint64)header->documentCount * sizeof(DocumentRecord) <= header->hashesOffset &&
+           header->hashesOffset + (quint64)header->documentCount * sizeof(quint64) <= header->termsOffset &&
+           header->termsOffset + (quint64)header->termCount * sizeof(TermRecord) <= header->postingsOffset &&
+           header->postingsOffset + header->postingCount * sizeof(quint32) <= header->stringsOffset &&
+           header->stringsOffset + header->stringsLength <= (quint64)size;
+}
+
+bool SearchIndex::baseContains(const uchar *base, quint64 hash)
+{
+    const FileHeader *header = reinterpret_cast<const FileHeader *>(base);
+    const quint64 *hashes = reinterpret_cast<const quint64 *>(base + header->hashesOffset);
+    return std::binary_search(hashes, hashes + header->documentCount, hash);
+}
+
+QByteArray SearchIndex::baseTerm(const uchar *base, quint32 term)
+{
+    const FileHeader *header = reinterpret_cast<const FileHeader *>(base);
+    const TermRecord &record = reinterpret_cast<const TermRecord *>(base + header->termsOffset)[term];
+    if ((quint64)record.stringOffset + record.length > header->stringsLength) {
+        return QByteArray();
+    }
+    return QByteArray::fromRawData(reinterpret_cast<const char *>(base + header->stringsOffset + record.stringOffset), record.length);
+}
+
+QVector<quint32> SearchIndex::basePostings(const QByteArray &term, bool prefix) const
+{
+    QVector<quint32> documents;
+    if (!mBase) {
+        return documents;
+    }
+    const FileHeader *header = reinterpret_cast<const FileHeader *>(mBase);
+    const TermRecord *terms = reinterpret_cast<const TermRecord *>(mBase + header->termsOffset);
+    const quint32 *postings = reinterpret_cast<const quint32 *>(mBase + header->postingsOffset);
+
+    // lower bound of the term in the sorted dictionary
+    quint32 low = 0;
+    quint32 high = header->termCount;
+    while (low < high) {
+        quint32 middle = low + (high - low) / 2;
+        if (compareTerms(baseTerm(mBase, middle), term) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    for (quint32 i = low; i < header->termCount; i++) {
+        QByteArray found = baseTerm(mBase, i);
+        if (prefix ? !found.startsWith(term) : found != term) {
+            break;
+        }
+        const TermRecord &record = terms[i];
+        if ((quint64)record.postingsIndex + record.postingsCount > header->postingCount) {
+            continue;
+        }
+        for (quint32 j = 0; j < record.postingsCount; j++) {
+            quint32 document = postings[record.postingsIndex + j];
+            if (document < header->documentCount) {
+                documents.append(document);
+            }
+        }
+    }
+    if (prefix) {
+        std::sort(documents.begin(), documents.end());
+        documents.erase(std::unique(documents.begin(), documents.end()), documents.end());
+    }
+    return documents;
+}
+
+QList<SearchHit> SearchIndex::search(const QString &query, const QString &conversationId, int limit) const
+{
+    QList<SearchHit> hits;
+    QList<bool> prefixes;
+    QList<QByteArray> terms;
+    Q_FOREACH (const QString &word, tokenize(query, &prefixes)) {
+        terms.append(word.toUtf8());
+    }
+    if (terms.isEmpty() || limit <= 0) {
+        return hits;
+    }
+    QByteArray conversation = conversationId.toUtf8();
+
+    // on disk documents are numbered from 0, pending ones from -1 down
+    QVector<QPair<quint64, qint64> > ordered;
+    if (mBase) {
+        // every term has to match, intersect starting from the first one
+        QVector<quint32> matches = basePostings(terms.first(), prefixes.first());
+        for (int i = 1; i < terms.size() && !matches.isEmpty(); i++) {
+            QVector<quint32> termMatches = basePostings(terms.at(i), prefixes.at(i));
+            QVector<quint32> both;
+            std::set_intersection(matches.constBegin(), matches.constEnd(),
+                                  termMatches.constBegin(), termMatches.constEnd(), std::back_inserter(both));
+            matches = both;
+        }
+        const FileHeader *header = reinterpret_cast<const FileHeader *>(mBase);
+        const DocumentRecord *documents = reinterpret_cast<const DocumentRecord *>(mBase + header->documentsOffset);
+        Q_FOREACH (quint32 number, matches) {
+            const DocumentRecord &document = documents[number];
+            if (conversation.isEmpty() ||
+                (document.conversationIdLength == conversation.size() &&
+                 (quint64)document.stringOffset + document.conversationIdLength <= header->stringsLength &&
+                 memcmp(mBase + header->stringsOffset + document.stringOffset, conversation.constData(), conversation.size()) == 0)) {
+                ordered.append(qMakePair(document.timestamp, (qint64)number));
+            }
+        }
+    }
+    for (int i = 0; i < mPending.size(); i++) {
+        const PendingDocument &document = mPending.at(i);
+        if (!conversation.isEmpty() && document.conversationId != conversation) {
+            continue;
+        }
+        bool matches = true;
+        for (int j = 0; j < terms.size() && matches; j++) {
+            matches = false;
+            Q_FOREACH (const QByteArray &term, document.terms) {
+                if (prefixes.at(j) ? term.startsWith(terms.at(j)) : term == terms.at(j)) {
+                    matches = true;
+                    break;
+                }
+            }
+        }
+        if (matches) {
+            ordered.append(qMakePair(document.timestamp, -(qint64)i - 1));
+        }
+    }
+
+    int count = qMin(limit, ordered.size());
+    std::partial_sort(ordered.begin(), ordered.begin() + count, ordered.end(), std::greater<QPair<quint64, qint64> >());
+    for (int i = 0; i < count; i++) {
+        qint64 number = ordered.at(i).second;
+        SearchHit hit;
+        hit.timestamp = ordered.at(i).first;
+        if (number < 0) {
+            const PendingDocument &document = mPending.at(-number - 1);
+            hit.conversationId = QString::fromUtf8(document.conversationId);
+            hit.eventId = QString::fromUtf8(document.eventId);
+        } else {
+            const FileHeader *header = reinterpret_cast<const FileHeader *>(mBase);
+            const DocumentRecord &document = reinterpret_cast<const DocumentRecord *>(mBase + header->documentsOffset)[number];
+            if ((quint64)document.stringOffset + document.conversationIdLength + document.eventIdLength > header->stringsLength) {
+                continue;
+            }
+            const char *strings = reinterpret_cast<const char *>(mBase + header->stringsOffset + document.stringOffset);
+            hit.conversationId = QString::fromUtf8(strings, document.conversationIdLength);
+            hit.eventId = QString::fromUtf8(strings + document.conversationIdLength, document.eventIdLength);
+        }
+        hits.append(hit);
+    }
+    return hits;
+}
+
+bool SearchIndex::merge(const QString &basePath, const QString &outputPath, const QList<PendingDocument> &documents)
+{
+    // runs on a worker thread, reads its own mapping of the current file
+    QFile baseFile(basePath);
+    const uchar *base = NULL;
+    if (baseFile.open(QIODevice::ReadOnly) && baseFile.size() > 0) {
+        uchar *data = baseFile.map(0, baseFile.size());
+        if (data && validBase(data, baseFile.size())) {
+            base = data;
+        } else if (data) {
+            baseFile.unmap(data);
+        }
+    }
+    FileHeader empty;
+    memset(&empty, 0, sizeof(FileHeader));
+    const FileHeader *baseHeader = base ? reinterpret_cast<const FileHeader *>(base) : &empty;
+
+    QList<const PendingDocument *> added;
+    QSet<quint64> seen;
+    Q_FOREACH (const PendingDocument &document, documents) {
+        if (!seen.contains(document.hash) && !(base && baseContains(base, document.hash))) {
+            added.append(&document);
+            seen.insert(document.hash);
+        }
+    }
+    if (added.isEmpty() && base && basePath == outputPath) {
+        baseFile.unmap(const_cast<uchar *>(base));
+        return true;
+    }
+
+    // existing documents keep their numbers, new ones follow
+    QByteArray documentSection;
+    QByteArray strings;
+    QVector<quint64> hashes;
+    if (base) {
+        documentSection = QByteArray(reinterpret_cast<const char *>(base + baseHeader->documentsOffset),
+                                     baseHeader->documentCount * sizeof(DocumentRecord));
+        strings = QByteArray(reinterpret_cast<const char *>(base + baseHeader->stringsOffset), baseHeader->stringsLength);
+        const quint64 *baseHashes = reinterpret_cast<const quint64 *>(base + baseHeader->hashesOffset);
+        hashes = QVector<quint64>(baseHeader->documentCount);
+        std::copy(baseHashes, baseHashes + baseHeader->documentCount, hashes.begin());
+    }
+    QMap<QByteArray, QVector<quint32> > addedTerms;
+    for (int i = 0; i < added.size(); i++) {
+        const PendingDocument &document = *added.at(i);
+        DocumentRecord record;
+        record.timestamp = document.timestamp;
+        record.stringOffset = strings.size();
+        record.conversationIdLength = document.conversationId.size();
+        record.eventIdLength = document.eventId.size();
+        documentSection.append(reinterpret_cast<const char *>(&record), sizeof(DocumentRecord));
+        strings += document.conversationId;
+        strings += document.eventId;
+        hashes.append(document.hash);
+        Q_FOREACH (const QByteArray &term, document.terms) {
+            if (!term.isEmpty()) {
+                addedTerms[term].append(baseHeader->documentCount + i);
+            }
+        }
+    }
+    std::sort(hashes.begin(), hashes.end());
+
+    // walk both sorted dictionaries together
+    QByteArray termSection;
+    QByteArray postingSection;
+    const TermRecord *baseTerms = base ? reinterpret_cast<const TermRecord *>(base + baseHeader->termsOffset) : NULL;
+    const quint32 *basePostingData = base ? reinterpret_cast<const quint32 *>(base + baseHeader->postingsOffset) : NULL;
+    quint32 baseIndex = 0;
+    quint64 postingCount = 0;
+    QMap<QByteArray, QVector<quint32> >::const_iterator it = addedTerms.constBegin();
+    while (baseIndex < baseHeader->termCount || it != addedTerms.constEnd()) {
+        int order;
+        if (baseIndex == baseHeader->termCount) {
+            order = 1;
+        } else if (it == addedTerms.constEnd()) {
+            order = -1;
+        } else {
+            order = compareTerms(baseTerm(base, baseIndex), it.key());
+        }
+
+        TermRecord record;
+        record.postingsIndex = postingCount;
+        if (order <= 0) {
+            const TermRecord &baseRecord = baseTerms[baseIndex];
+            record.stringOffset = baseRecord.stringOffset;
+            record.length = baseRecord.length;
+            if ((quint64)baseRecord.postingsIndex + baseRecord.postingsCount <= baseHeader->postingCount) {
+                postingSection.append(reinterpret_cast<const char *>(basePostingData + baseRecord.postingsIndex),
+                                      baseRecord.postingsCount * sizeof(quint32));
+                postingCount += baseRecord.postingsCount;
+            }
+            baseIndex++;
+        } else {
+            record.stringOffset = strings.size();
+            record.length = it.key().size();
+            strings += it.key();
+        }
+        if (order >= 0) {
+            postingSection.append(reinterpret_cast<const char *>(it.value().constData()), it.value().size() * sizeof(quint32));
+            postingCount += it.value().size();
+            ++it;
+        }
+        record.postingsCount = postingCount - record.postingsIndex;
+        termSection.append(reinterpret_cast<const char *>(&record), sizeof(TermRecord));
+    }
+
+    FileHeader header;
+    header.magic = FILE_MAGIC;
+    header.version = FILE_VERSION;
+    header.documentCount = hashes.size();
+    header.termCount = termSection.size() / sizeof(TermRecord);
+    header.postingCount = postingCount;
+    header.documentsOffset = sizeof(FileHeader);
+    header.hashesOffset = header.documentsOffset + documentSection.size();
+    header.termsOffset = header.hashesOffset + hashes.size() * sizeof(quint64);
+    header.postingsOffset = header.termsOffset + termSection.size();
+    header.stringsOffset = header.postingsOffset + postingSection.size();
+    header.stringsLength = strings.size();
+
+    QSaveFile output(outputPath);
+    bool written = output.open(QIODevice::WriteOnly) &&
+                   output.write(reinterpret_cast<const char *>(&header), sizeof(FileHeader)) == sizeof(FileHeader) &&
+                   output.write(documentSection) == documentSection.size() &&
+                   output.write(reinterpret_cast<const char *>(hashes.constData()), hashes.size() * sizeof(quint64)) ==
+                       (qint64)(hashes.size() * sizeof(quint64)) &&
+                   output.write(termSection) == termSection.size() &&
+                   output.write(postingSection) == postingSection.size() &&
+                   output.write(strings) == strings.size() &&
+                   output.commit();
+    if (base) {
+        baseFile.unmap(const_cast<uchar *>(base));
+    }
+    return written;
+}
+
+bool SearchIndex::backfill(const QString &basePath, const QString &eventStorePath)
+{
+    // one segment at a time, built aside so an interrupted run starts over
+    QString building = basePath + ".backfill";
+    QFile::remove(building);
+    Q_FOREACH (const QString &segment, EventStore::segmentFiles(eventStorePath)) {
+        QList<PendingDocument> documents;
+        Q_FOREACH (const ClientEvent &event, EventStore::readSegment(segment)) {
+            PendingDocument document;
+            if (makeDocument(event, document)) {
+                documents.append(document);
+            }
+        }
+        if (!merge(building, building, documents)) {
+            return false;
+        }
+    }
+    if (!QFile::exists(building) && !merge(building, building, QList<PendingDocument>())) {
+        return false;
+    }
+    QFile::remove(basePath);
+    return QFile::rename(building, basePath);
+}
+
+qint64 SearchIndex::indexBytes() const
+{
+    // the on-disk part is mapped, only the pending documents live on the heap
+    qint64 bytes = mPendingHashes.size() * sizeof(quint64);
+    Q_FOREACH (const PendingDocument &document, mPending) {
+        bytes += sizeof(PendingDocument) + document.conversationId.capacity() + document.eventId.capacity();
+        Q_FOREACH (const QByteArray &term, document.terms) {
+            bytes += term.capacity();
+        }
+    }
+    return bytes;
+}
@@ -0,0 +1,131 @@
+/**
+ * libhangish
+ * Copyright (C) 2015 Tiago Salem Herrmann
+ * Copyright (C) 2015 Daniele Rogora
+ *
+ * This file is part of libhangish.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SEARCHINDEX_H
+#define SEARCHINDEX_H
+
+#include <QFile>
+#include <QFutureWatcher>
+#include <QList>
+#include <QObject>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+#include "types.h"
+
+/*
+ * Inverted index over the segment text of ClientEvents. The sorted term
+ * dictionary, the postings and the documents live in a memory mapped
+ * file on disk; events indexed since it was last written are kept in a
+ * short pending log and folded into a new file by a background merge
+ * once SEARCH_MERGE_EVENTS of them have piled up. Terms are case folded
+ * words, so prefixes of a term form one contiguous dictionary range.
+ */
+class SearchIndex : public QObject
+{
+    Q_OBJECT
+
+public:
+    SearchIndex(const QString &path);
+    ~SearchIndex();
+    bool open(const QString &eventStorePath = QString());
+    bool add(const ClientEvent &event);
+    QList<SearchHit> search(const QString &query, const QString &conversationId, int limit) const;
+    qint64 indexBytes() const;
+
+    static QStringList tokenize(const QString &text, QList<bool> *prefixes = NULL);
+
+private Q_SLOTS:
+    void onRebuildFinished();
+
+private:
+    struct RecordHeader {
+        quint32 magic;
+        quint32 termsLength;
+        quint64 timestamp;
+        quint16 conversationIdLength;
+        quint16 eventIdLength;
+        quint16 checksum;
+        quint16 reserved;
+    };
+
+    struct FileHeader {
+        quint32 magic;
+        quint32 version;
+        quint32 documentCount;
+        quint32 termCount;
+        quint64 postingCount;
+        quint64 documentsOffset;
+        quint64 hashesOffset;
+        quint64 termsOffset;
+        quint64 postingsOffset;
+        quint64 stringsOffset;
+        quint64 stringsLength;
+    };
+
+    struct DocumentRecord {
+        quint64 timestamp;
+        quint32 stringOffset;
+        quint16 conversationIdLength;
+        quint16 eventIdLength;
+    };
+
+    struct TermRecord {
+        quint32 stringOffset;
+        quint32 length;
+        quint32 postingsIndex;
+        quint32 postingsCount;
+    };
+
+    struct PendingDocument {
+        QByteArray conversationId;
+        QByteArray eventId;
+        quint64 timestamp;
+        quint64 hash;
+        QList<QByteArray> terms;
+    };
+
+    static bool makeDocument(const ClientEvent &event, PendingDocument &document);
+    static bool validBase(const uchar *base, qint64 size);
+    static bool baseContains(const uchar *base, quint64 hash);
+    static QByteArray baseTerm(const uchar *base, quint32 term);
+    static bool merge(const QString &basePath, const QString &outputPath, const QList<PendingDocument> &documents);
+    static bool backfill(const QString &basePath, const QString &eventStorePath);
+
+    bool mapBase();
+    void unmapBase();
+    QVector<quint32> basePostings(const QByteArray &term, bool prefix) const;
+    bool writePending(const PendingDocument &document);
+    void rewritePending();
+    void startMerge();
+
+    QFile mBaseFile;
+    QFile mPendingFile;
+    const uchar *mBase;
+    qint64 mBaseSize;
+    QList<PendingDocument> mPending;
+    QSet<quint64> mPendingHashes;
+    QFutureWatcher<bool> *mRebuild;
+};
+
+#endif // SEARCHINDEX_H
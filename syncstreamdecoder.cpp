@@ -0,0 +1,105 @@
+/**
+ * libhangish
+ * Copyright (C) 2015 Tiago Salem Herrmann
+ * Copyright (C) 2015 Daniele Rogora
+ *
+ * This file is part of libhangish.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "syncstreamdecoder.h"
+
+// index of conversationState in ["csanerp", header, syncTimestamp, states, ...]
+#define STATES_FIELD 3
+
+SyncStreamDecoder::SyncStreamDecoder() :
+    mDepth(0),
+    mField(0),
+    mInString(false),
+    mEscaped(false),
+    mInStates(false)
+{
+}
+
+QList<QByteArray> SyncStreamDecoder::feed(const QByteArray &data)
+{
+    QList<QByteArray> states;
+    for (int i = 0; i < data.size(); i++) {
+        char c = data.at(i);
+        // everything below the state list belongs to the current state
+        QByteArray &sink = (mInStates && mDepth >= 3) || (mInStates && mDepth == 2 && c == '[') ? mCurrent : mSkeleton;
+
+        if (mInString) {
+            if (mEscaped) {
+                mEscaped = false;
+            } else if (c == '\\') {
+                mEscaped = true;
+            } else if (c == '"') {
+                mInString = false;
+            }
+            sink.append(c);
+            continue;
+        }
+
+        switch (c) {
+        case '"':
+            mInString = true;
+            sink.append(c);
+            break;
+        case '[':
+        case '{':
+            if (mDepth == 1 && mField == STATES_FIELD && c == '[') {
+                mInStates = true;
+            }
+            mDepth++;
+            sink.append(c);
+            break;
+        case ']':
+        case '}':
+            mDepth--;
+            if (mInStates && mDepth == 2) {
+                mCurrent.append(c);
+                states.append(mCurrent);
+                mCurrent.clear();
+            } else {
+                if (mInStates && mDepth == 1) {
+                    mInStates = false;
+                }
+                sink.append(c);
+            }
+            break;
+        case ',':
+            if (mDepth == 1) {
+                mField++;
+            }
+            // separators between states are dropped with them
+            if (!(mInStates && mDepth == 2)) {
+                sink.append(c);
+            }
+            break;
+        default:
+            if (!(mInStates && mDepth == 2)) {
+                sink.append(c);
+            }
+            break;
+        }
+    }
+    return states;
+}
+
+QByteArray SyncStreamDecoder::skeleton() const
+{
+    return mSkeleton;
+}
@@ -0,0 +1,53 @@
+/**
+ * libhangish
+ * Copyright (C) 2015 Tiago Salem Herrmann
+ * Copyright (C) 2015 Daniele Rogora
+ *
+ * This file is part of libhangish.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SYNCSTREAMDECODER_H
+#define SYNCSTREAMDECODER_H
+
+#include <QByteArray>
+#include <QList>
+
+/*
+ * Incremental splitter for protojson syncallnewevents responses. Bytes
+ * are fed as they arrive; every complete element of the conversation
+ * state list is handed back as soon as its closing bracket is seen, and
+ * only the rest of the response is kept, as a skeleton with an empty
+ * state list.
+ */
+class SyncStreamDecoder
+{
+
+public:
+    SyncStreamDecoder();
+    QList<QByteArray> feed(const QByteArray &data);
+    QByteArray skeleton() const;
+
+private:
+    int mDepth;
+    int mField;
+    bool mInString;
+    bool mEscaped;
+    bool mInStates;
+    QByteArray mSkeleton;
+    QByteArray mCurrent;
+};
+
+#endif // SYNCSTREAMDECODER_H
@@ -0,0 +1,120 @@
+/**
+ * libhangish
+ * Copyright (C) 2015 Tiago Salem Herrmann
+ * Copyright (C) 2015 Daniele Rogora
+ *
+ * This file is part of libhangish.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QtTest>
+
+#include "completionindex.h"
+#include "idtable.h"
+
+static ClientEntity makeUser(const char *name, const char *firstName, const char *email)
+{
+    ClientEntity entity;
+    entity.mutable_properties()->set_displayname(name);
+    entity.mutable_properties()->set_firstname(firstName);
+    entity.mutable_properties()->add_email(email);
+    return entity;
+}
+
+static ClientConversation makeConversation(const char *name, qint64 sortTimestamp)
+{
+    ClientConversation conversation;
+    conversation.set_name(name);
+    conversation.mutable_selfconversationstate()->set_sorttimestamp(sortTimestamp);
+    return conversation;
+}
+
+static QStringList ids(const QList<CompletionMatch> &matches)
+{
+    QStringList result;
+    Q_FOREACH (const CompletionMatch &match, matches) {
+        result.append(match.id);
+    }
+    return result;
+}
+
+class CompletionIndexTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void matchesNamesAndEmails();
+    void ranksFullNamesFirst();
+    void ranksConversationsByActivity();
+    void replacesKeys();
+};
+
+void CompletionIndexTest::matchesNamesAndEmails()
+{
+    CompletionIndex index;
+    index.setUser(IdTable::intern(QString("user-ada")), makeUser("Ada Lovelace", "Ada", "countess@example.com"));
+    index.setUser(IdTable::intern(QString("user-alan")), makeUser("Alan Turing", "Alan", "alan@example.com"));
+
+    QCOMPARE(ids(index.complete("love", 10)), QStringList() << "user-ada");
+    QCOMPARE(ids(index.complete("COUNT", 10)), QStringList() << "user-ada");
+    QCOMPARE(index.complete("a", 10).size(), 2);
+    QCOMPARE(index.complete("a", 1).size(), 1);
+    QVERIFY(index.complete("zzz", 10).isEmpty());
+    QVERIFY(index.complete("", 10).isEmpty());
+
+    QList<CompletionMatch> matches = index.complete("turing", 10);
+    QCOMPARE(matches.size(), 1);
+    QCOMPARE(matches.first().name, QString("Alan Turing"));
+    QVERIFY(!matches.first().isConversation);
+    QVERIFY(index.indexBytes() > 0);
+}
+
+void CompletionIndexTest::ranksFullNamesFirst()
+{
+    CompletionIndex index;
+    // one matches on a later word only, the other on the start of the name
+    index.setUser(IdTable::intern(QString("user-grace")), makeUser("Grace Hopper", "Grace", "grace@example.com"));
+    index.setUser(IdTable::intern(QString("user-hop")), makeUser("Hop Along", "Hop", "hop@example.com"));
+    QCOMPARE(ids(index.complete("hop", 10)), QStringList() << "user-hop" << "user-grace");
+}
+
+void CompletionIndexTest::ranksConversationsByActivity()
+{
+    CompletionIndex index;
+    index.setConversation(IdTable::intern(QString("conv-old")), makeConversation("Team chat", 1000));
+    index.setConversation(IdTable::intern(QString("conv-new")), makeConversation("Team lunch", 2000));
+    QList<CompletionMatch> matches = index.complete("team", 10);
+    QCOMPARE(ids(matches), QStringList() << "conv-new" << "conv-old");
+    QVERIFY(matches.first().isConversation);
+
+    // activity alone moves it up, without a new name
+    index.setConversation(IdTable::intern(QString("conv-old")), makeConversation("Team chat", 3000));
+    QCOMPARE(ids(index.complete("team", 10)), QStringList() << "conv-old" << "conv-new");
+}
+
+void CompletionIndexTest::replacesKeys()
+{
+    CompletionIndex index;
+    IdHandle id = IdTable::intern(QString("conv-renamed"));
+    index.setConversation(id, makeConversation("Old name", 1000));
+    index.setConversation(id, makeConversation("New name", 1000));
+    QVERIFY(index.complete("old", 10).isEmpty());
+    QCOMPARE(ids(index.complete("new", 10)), QStringList() << "conv-renamed");
+    QCOMPARE(index.complete("name", 10).size(), 1);
+}
+
+QTEST_GUILESS_MAIN(CompletionIndexTest)
+
+#include "tst_completionindex.moc"
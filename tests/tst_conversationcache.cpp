@@ -0,0 +1,193 @@
+/**
+ * libhangish
+ * Copyright (C) 2015 Tiago Salem Herrmann
+ * Copyright (C) 2015 Daniele Rogora
+ *
+ * This file is part of libhangish.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QSet>
+#include <QtTest>
+
+#include "conversationcache.h"
+#include "idtable.h"
+
+static ClientConversationState *makeState(IdHandle id, int events, qint64 sortTimestamp)
+{
+    ClientConversationState *state = new ClientConversationState();
+    state->mutable_conversationid()->set_id(IdTable::toStdString(id));
+    state->mutable_conversation()->mutable_selfconversationstate()->set_sorttimestamp(sortTimestamp);
+    for (int i = 0; i < events; i++) {
+        ClientEvent *event = state->add_event();
+        event->set_eventid(QByteArray::number(i).constData());
+        event->set_timestamp(sortTimestamp - events + i);
+        event->mutable_chatmessage()->mutable_messagecontent()->add_segment()->set_text(std::string(500, 'a' + i % 26));
+    }
+    return state;
+}
+
+static IdHandle conversation(int number)
+{
+    return IdTable::intern(QString("cache-conversation-%1").arg(number));
+}
+
+class ConversationCacheTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void unlimitedBudgetKeepsEverything();
+    void evictsLeastRecentlyUsed();
+    void detachCopiesOnlyHandedOutStates();
+    void updateAccountsChanges();
+    void mostRecentBySortTimestamp();
+    void iteratorPeeks();
+};
+
+void ConversationCacheTest::unlimitedBudgetKeepsEverything()
+{
+    ConversationCache cache;
+    cache.setBudget(0);
+    for (int i = 0; i < 20; i++) {
+        cache.insert(conversation(i), makeState(conversation(i), 10, 1000 + i));
+    }
+    QCOMPARE(cache.size(), 20);
+    QCOMPARE(cache.compressedBytes(), (qint64)0);
+    QVERIFY(cache.residentBytes() > 0);
+}
+
+void ConversationCacheTest::evictsLeastRecentlyUsed()
+{
+    ConversationCache cache;
+    cache.setBudget(0);
+    cache.insert(conversation(0), makeState(conversation(0), 10, 1000));
+    qint64 oneState = cache.residentBytes();
+
+    cache.setBudget(oneState * 3);
+    for (int i = 1; i < 10; i++) {
+        cache.insert(conversation(i), makeState(conversation(i), 10, 1000 + i));
+        QVERIFY(cache.residentBytes() <= cache.budget());
+    }
+    QCOMPARE(cache.size(), 10);
+    QVERIFY(cache.compressedBytes() > 0);
+
+    // the oldest one was compressed and comes back intact
+    ConversationStatePtr state = cache.value(conversation(0));
+    QVERIFY(state);
+    QCOMPARE(state->event_size(), 10);
+    QVERIFY(state->conversationid().id() == IdTable::toStdString(conversation(0)));
+    QVERIFY(state->event(9).chatmessage().messagecontent().segment(0).text() == std::string(500, 'j'));
+    QVERIFY(cache.residentBytes() <= cache.budget());
+
+    // states handed out before eviction stay readable
+    ConversationStatePtr held = cache.value(conversation(1));
+    for (int i = 2; i < 10; i++) {
+        cache.value(conversation(i));
+    }
+    QCOMPARE(held->event_size(), 10);
+}
+
+void ConversationCacheTest::detachCopiesOnlyHandedOutStates()
+{
+    ConversationCache cache;
+    cache.setBudget(0);
+    cache.insert(conversation(0), makeState(conversation(0), 2, 1000));
+
+    ConversationStatePtr held = cache.value(conversation(0));
+    ClientConversationState *writable = cache.detach(conversation(0));
+    QVERIFY(writable != held.data());
+    writable->add_event()->set_eventid("new");
+    cache.update(conversation(0));
+    QCOMPARE(held->event_size(), 2);
+    QCOMPARE(cache.value(conversation(0))->event_size(), 3);
+
+    // nobody holds it any more, changes go in place
+    held.clear();
+    ClientConversationState *first = cache.detach(conversation(0));
+    ClientConversationState *second = cache.detach(conversation(0));
+    QCOMPARE(first, second);
+    QVERIFY(!cache.detach(conversation(99)));
+}
+
+void ConversationCacheTest::updateAccountsChanges()
+{
+    ConversationCache cache;
+    cache.setBudget(0);
+    cache.insert(conversation(0), makeState(conversation(0), 1, 1000));
+    qint64 before = cache.residentBytes();
+
+    ClientConversationState *state = cache.detach(conversation(0));
+    for (int i = 0; i < 20; i++) {
+        state->add_event()->mutable_chatmessage()->mutable_messagecontent()->add_segment()->set_text(std::string(500, 'z'));
+    }
+    cache.update(conversation(0));
+    QVERIFY(cache.residentBytes() > before + 20 * 500);
+
+    // growing past the budget evicts the others, never the updated one
+    cache.insert(conversation(1), makeState(conversation(1), 1, 1001));
+    cache.setBudget(cache.residentBytes());
+    state = cache.detach(conversation(1));
+    for (int i = 0; i < 20; i++) {
+        state->add_event()->mutable_chatmessage()->mutable_messagecontent()->add_segment()->set_text(std::string(500, 'y'));
+    }
+    cache.update(conversation(1));
+    QVERIFY(cache.compressedBytes() > 0);
+    QCOMPARE(cache.detach(conversation(1)), state);
+}
+
+void ConversationCacheTest::mostRecentBySortTimestamp()
+{
+    ConversationCache cache;
+    cache.setBudget(0);
+    cache.insert(conversation(0), makeState(conversation(0), 1, 3000));
+    cache.insert(conversation(1), makeState(conversation(1), 1, 1000));
+    cache.insert(conversation(2), makeState(conversation(2), 1, 2000));
+    QList<IdHandle> recent = cache.mostRecent(2);
+    QCOMPARE(recent.size(), 2);
+    QCOMPARE(recent.at(0), conversation(0));
+    QCOMPARE(recent.at(1), conversation(2));
+    QCOMPARE(cache.mostRecent(10).size(), 3);
+}
+
+void ConversationCacheTest::iteratorPeeks()
+{
+    ConversationCache cache;
+    cache.setBudget(0);
+    cache.insert(conversation(0), makeState(conversation(0), 10, 1000));
+    cache.setBudget(cache.residentBytes() * 2);
+    for (int i = 1; i < 5; i++) {
+        cache.insert(conversation(i), makeState(conversation(i), 10, 1000 + i));
+    }
+    qint64 resident = cache.residentBytes();
+    qint64 compressed = cache.compressedBytes();
+    QVERIFY(compressed > 0);
+
+    QSet<QString> keys;
+    ConversationCache::Iterator it(cache);
+    while (it.hasNext()) {
+        it.next();
+        QVERIFY(it.value());
+        QCOMPARE(QString::fromStdString(it.value()->conversationid().id()), it.key());
+        keys.insert(it.key());
+    }
+    QCOMPARE(keys.size(), 5);
+    QCOMPARE(cache.residentBytes(), resident);
+    QCOMPARE(cache.compressedBytes(), compressed);
+}
+
+QTEST_GUILESS_MAIN(ConversationCacheTest)
+
+#include "tst_conversationcache.moc"
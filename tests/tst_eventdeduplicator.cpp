@@ -0,0 +1,115 @@
+/**
+ * libhangish
+ * Copyright (C) 2015 Tiago Salem Herrmann
+ * Copyright (C) 2015 Daniele Rogora
+ *
+ * This file is part of libhangish.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QTemporaryDir>
+#include <QtTest>
+
+#include "eventdeduplicator.h"
+#include "eventstore.h"
+
+static ClientEvent makeEvent(int number)
+{
+    ClientEvent event;
+    event.mutable_conversationid()->set_id("dedup-conversation");
+    event.set_eventid(QByteArray("event-").append(QByteArray::number(number)).constData());
+    event.set_timestamp(1000 + number);
+    return event;
+}
+
+class EventDeduplicatorTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void recentDuplicates();
+    void eventsWithoutIdAreNew();
+    void bloomHitWithoutStoreIsDelivered();
+    void storeConfirmsBloomHit();
+    void storeSurvivesRestart();
+};
+
+void EventDeduplicatorTest::recentDuplicates()
+{
+    EventDeduplicator deduplicator;
+    QVERIFY(deduplicator.isNew(makeEvent(1), NULL));
+    QVERIFY(deduplicator.isNew(makeEvent(2), NULL));
+    QVERIFY(!deduplicator.isNew(makeEvent(1), NULL));
+    QVERIFY(!deduplicator.isNew(makeEvent(2), NULL));
+    QCOMPARE(deduplicator.counters().unique, (quint64)2);
+    QCOMPARE(deduplicator.counters().duplicates, (quint64)2);
+    QCOMPARE(deduplicator.counters().bloomChecks, (quint64)0);
+}
+
+void EventDeduplicatorTest::eventsWithoutIdAreNew()
+{
+    EventDeduplicator deduplicator;
+    ClientEvent event;
+    event.mutable_conversationid()->set_id("dedup-conversation");
+    QVERIFY(deduplicator.isNew(event, NULL));
+    QVERIFY(deduplicator.isNew(event, NULL));
+    QCOMPARE(deduplicator.counters().unique, (quint64)2);
+}
+
+void EventDeduplicatorTest::bloomHitWithoutStoreIsDelivered()
+{
+    // pushed out of the LRU, only the Bloom filter still has it
+    EventDeduplicator deduplicator;
+    for (int i = 0; i <= DEDUP_RECENT_EVENTS; i++) {
+        QVERIFY(deduplicator.isNew(makeEvent(i), NULL));
+    }
+    QVERIFY(deduplicator.isNew(makeEvent(0), NULL));
+    QCOMPARE(deduplicator.counters().bloomChecks, (quint64)1);
+    QCOMPARE(deduplicator.counters().bloomFalsePositives, (quint64)0);
+}
+
+void EventDeduplicatorTest::storeConfirmsBloomHit()
+{
+    QTemporaryDir dir;
+    EventStore store(dir.path());
+    QVERIFY(store.open());
+    EventDeduplicator deduplicator;
+    for (int i = 0; i <= DEDUP_RECENT_EVENTS; i++) {
+        QVERIFY(deduplicator.isNew(makeEvent(i), &store));
+        QVERIFY(store.append(makeEvent(i)));
+    }
+    QVERIFY(!deduplicator.isNew(makeEvent(0), &store));
+    QCOMPARE(deduplicator.counters().bloomChecks, (quint64)1);
+    QCOMPARE(deduplicator.counters().bloomFalsePositives, (quint64)0);
+}
+
+void EventDeduplicatorTest::storeSurvivesRestart()
+{
+    QTemporaryDir dir;
+    EventStore store(dir.path());
+    QVERIFY(store.open());
+    QVERIFY(store.append(makeEvent(1)));
+
+    // a fresh deduplicator, as after a restart, still knows stored events
+    EventDeduplicator deduplicator;
+    QVERIFY(!deduplicator.isNew(makeEvent(1), &store));
+    QVERIFY(deduplicator.isNew(makeEvent(2), &store));
+    QCOMPARE(deduplicator.counters().duplicates, (quint64)1);
+    QCOMPARE(deduplicator.counters().unique, (quint64)1);
+}
+
+QTEST_GUILESS_MAIN(EventDeduplicatorTest)
+
+#include "tst_eventdeduplicator.moc"
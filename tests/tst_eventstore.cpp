@@ -0,0 +1,158 @@
+/**
+ * libhangish
+ * Copyright (C) 2015 Tiago Salem Herrmann
+ * Copyright (C) 2015 Daniele Rogora
+ *
+ * This file is part of libhangish.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QFile>
+#include <QTemporaryDir>
+#include <QtTest>
+
+#include "eventstore.h"
+
+#define RECORD_HEADER_SIZE 24
+
+static ClientEvent makeEvent(const char *conversationId, const char *eventId, quint64 timestamp, const char *text)
+{
+    ClientEvent event;
+    event.mutable_conversationid()->set_id(conversationId);
+    event.set_eventid(eventId);
+    event.set_timestamp(timestamp);
+    event.mutable_chatmessage()->mutable_messagecontent()->add_segment()->set_text(text);
+    return event;
+}
+
+static qint64 recordSize(const ClientEvent &event)
+{
+    std::string payload;
+    event.SerializePartialToString(&payload);
+    return RECORD_HEADER_SIZE + event.conversationid().id().size() + event.eventid().size() + payload.size();
+}
+
+class EventStoreTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void appendAndReopen();
+    void rejectsDuplicates();
+    void tornTailIsDropped();
+    void readSegmentMatchesStore();
+};
+
+void EventStoreTest::appendAndReopen()
+{
+    QTemporaryDir dir;
+    {
+        EventStore store(dir.path());
+        QVERIFY(store.open());
+        QVERIFY(store.append(makeEvent("conv-a", "ev-2", 200, "second")));
+        QVERIFY(store.append(makeEvent("conv-a", "ev-1", 100, "first")));
+        QVERIFY(store.append(makeEvent("conv-b", "ev-3", 300, "other")));
+    }
+
+    EventStore store(dir.path());
+    QVERIFY(store.open());
+    QVERIFY(store.contains(QString("conv-a"), 100, QString("ev-1")));
+    QVERIFY(store.contains(QString("conv-b"), 300, QString("ev-3")));
+    QVERIFY(!store.contains(QString("conv-b"), 100, QString("ev-1")));
+    QCOMPARE(store.newestTimestamp(), (quint64)300);
+    QCOMPARE(store.newestTimestamp(QString("conv-a")), (quint64)200);
+
+    // kept in timestamp order whatever order they came in
+    QList<ClientEvent> events = store.lastEvents(QString("conv-a"), 10);
+    QCOMPARE(events.size(), 2);
+    QCOMPARE(QString::fromStdString(events.at(0).eventid()), QString("ev-1"));
+    QCOMPARE(QString::fromStdString(events.at(1).chatmessage().messagecontent().segment(0).text()), QString("second"));
+}
+
+void EventStoreTest::rejectsDuplicates()
+{
+    QTemporaryDir dir;
+    EventStore store(dir.path());
+    QVERIFY(store.open());
+    QVERIFY(store.append(makeEvent("conv-a", "ev-1", 100, "first")));
+    QVERIFY(!store.append(makeEvent("conv-a", "ev-1", 100, "first")));
+    QVERIFY(!store.append(makeEvent("conv-a", "", 100, "no id")));
+    QCOMPARE(store.lastEvents(QString("conv-a"), 10).size(), 1);
+}
+
+void EventStoreTest::tornTailIsDropped()
+{
+    QTemporaryDir dir;
+    ClientEvent first = makeEvent("conv-a", "ev-1", 100, "first");
+    ClientEvent second = makeEvent("conv-a", "ev-2", 200, "second");
+    ClientEvent torn = makeEvent("conv-a", "ev-3", 300, "torn");
+    {
+        EventStore store(dir.path());
+        QVERIFY(store.open());
+        QVERIFY(store.append(first));
+        QVERIFY(store.append(second));
+        QVERIFY(store.append(torn));
+    }
+
+    // damage the last byte of the last record, as a crash mid-write would
+    QStringList segments = EventStore::segmentFiles(dir.path());
+    QCOMPARE(segments.size(), 1);
+    QFile segment(segments.first());
+    QVERIFY(segment.open(QIODevice::ReadWrite));
+    qint64 end = recordSize(first) + recordSize(second) + recordSize(torn);
+    QVERIFY(segment.seek(end - 1));
+    char byte;
+    QVERIFY(segment.getChar(&byte));
+    QVERIFY(segment.seek(end - 1));
+    QVERIFY(segment.putChar(byte ^ 0x5a));
+    segment.close();
+
+    {
+        EventStore store(dir.path());
+        QVERIFY(store.open());
+        QVERIFY(store.contains(QString("conv-a"), 200, QString("ev-2")));
+        QVERIFY(!store.contains(QString("conv-a"), 300, QString("ev-3")));
+        QCOMPARE(store.newestTimestamp(), (quint64)200);
+        // the next append takes the place of the torn record
+        QVERIFY(store.append(makeEvent("conv-a", "ev-4", 400, "after")));
+    }
+
+    EventStore store(dir.path());
+    QVERIFY(store.open());
+    QList<ClientEvent> events = store.lastEvents(QString("conv-a"), 10);
+    QCOMPARE(events.size(), 3);
+    QCOMPARE(QString::fromStdString(events.at(2).eventid()), QString("ev-4"));
+}
+
+void EventStoreTest::readSegmentMatchesStore()
+{
+    QTemporaryDir dir;
+    {
+        EventStore store(dir.path());
+        QVERIFY(store.open());
+        for (int i = 0; i < 50; i++) {
+            QVERIFY(store.append(makeEvent("conv-a", QByteArray::number(i).constData(), 1000 + i, "text")));
+        }
+    }
+    QStringList segments = EventStore::segmentFiles(dir.path());
+    QCOMPARE(segments.size(), 1);
+    QList<ClientEvent> events = EventStore::readSegment(segments.first());
+    QCOMPARE(events.size(), 50);
+    QCOMPARE(events.last().timestamp(), (quint64)1049);
+}
+
+QTEST_GUILESS_MAIN(EventStoreTest)
+
+#include "tst_eventstore.moc"
@@ -0,0 +1,115 @@
+/**
+ * libhangish
+ * Copyright (C) 2015 Tiago Salem Herrmann
+ * Copyright (C) 2015 Daniele Rogora
+ *
+ * This file is part of libhangish.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QtConcurrentRun>
+#include <QFuture>
+#include <QtTest>
+
+#include "idtable.h"
+
+static QList<IdHandle> internRange(int first, int count)
+{
+    QList<IdHandle> handles;
+    for (int i = first; i < first + count; i++) {
+        handles.append(IdTable::intern(QString("thread-id-%1").arg(i)));
+    }
+    return handles;
+}
+
+class IdTableTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void internIsStable();
+    void emptyIdIsZero();
+    void findDoesNotIntern();
+    void roundTrips();
+    void concurrentIntern();
+};
+
+void IdTableTest::internIsStable()
+{
+    IdHandle a = IdTable::intern(QString("UgwAbc123"));
+    IdHandle b = IdTable::intern(QString("UgwDef456"));
+    QVERIFY(a != 0);
+    QVERIFY(b != 0);
+    QVERIFY(a != b);
+    QCOMPARE(IdTable::intern(QString("UgwAbc123")), a);
+    QCOMPARE(IdTable::intern(std::string("UgwAbc123")), a);
+    QCOMPARE(IdTable::intern("UgwAbc123", 9), a);
+}
+
+void IdTableTest::emptyIdIsZero()
+{
+    QCOMPARE(IdTable::intern(QString()), (IdHandle)0);
+    QCOMPARE(IdTable::intern(std::string()), (IdHandle)0);
+    QCOMPARE(IdTable::find(QString()), (IdHandle)0);
+    QVERIFY(IdTable::toString(0).isEmpty());
+}
+
+void IdTableTest::findDoesNotIntern()
+{
+    int size = IdTable::size();
+    QCOMPARE(IdTable::find(QString("never interned")), (IdHandle)0);
+    QCOMPARE(IdTable::size(), size);
+
+    IdHandle handle = IdTable::intern(QString("interned later"));
+    QCOMPARE(IdTable::size(), size + 1);
+    QCOMPARE(IdTable::find(QString("interned later")), handle);
+    QCOMPARE(IdTable::find(std::string("interned later")), handle);
+}
+
+void IdTableTest::roundTrips()
+{
+    QString id = QString::fromUtf8("conversation-\xc3\xa9\xe2\x82\xac");
+    IdHandle handle = IdTable::intern(id);
+    QCOMPARE(IdTable::toString(handle), id);
+    QCOMPARE(IdTable::toUtf8(handle), id.toUtf8());
+    QCOMPARE(IdTable::toStdString(handle), std::string(id.toUtf8().constData()));
+    QVERIFY(IdTable::bytes() > 0);
+}
+
+void IdTableTest::concurrentIntern()
+{
+    // overlapping ranges, every thread has to agree on the handles
+    QList<QFuture<QList<IdHandle> > > futures;
+    for (int i = 0; i < 4; i++) {
+        futures.append(QtConcurrent::run(internRange, i * 500, 1000));
+    }
+    QHash<QString, IdHandle> seen;
+    for (int i = 0; i < futures.size(); i++) {
+        QList<IdHandle> handles = futures[i].result();
+        for (int j = 0; j < handles.size(); j++) {
+            QString id = QString("thread-id-%1").arg(i * 500 + j);
+            QCOMPARE(IdTable::toString(handles.at(j)), id);
+            if (seen.contains(id)) {
+                QCOMPARE(handles.at(j), seen.value(id));
+            }
+            seen.insert(id, handles.at(j));
+        }
+    }
+    QCOMPARE(seen.size(), 2500);
+}
+
+QTEST_GUILESS_MAIN(IdTableTest)
+
+#include "tst_idtable.moc"
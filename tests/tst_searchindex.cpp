@@ -0,0 +1,137 @@
+/**
+ * libhangish
+ * Copyright (C) 2015 Tiago Salem Herrmann
+ * Copyright (C) 2015 Daniele Rogora
+ *
+ * This file is part of libhangish.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QTemporaryDir>
+#include <QtTest>
+
+#include "eventstore.h"
+#include "searchindex.h"
+
+static ClientEvent makeEvent(const char *conversationId, int number, const QString &text)
+{
+    ClientEvent event;
+    event.mutable_conversationid()->set_id(conversationId);
+    event.set_eventid(QByteArray("event-").append(QByteArray::number(number)).constData());
+    event.set_timestamp(1000 + number);
+    event.mutable_chatmessage()->mutable_messagecontent()->add_segment()->set_text(text.toStdString());
+    return event;
+}
+
+class SearchIndexTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void tokenize();
+    void searchPending();
+    void mergeKeepsResults();
+    void backfillFromEventStore();
+};
+
+void SearchIndexTest::tokenize()
+{
+    QList<bool> prefixes;
+    QStringList terms = SearchIndex::tokenize(QString::fromUtf8("Hello, W\xc3\x96RLD hel*"), &prefixes);
+    QCOMPARE(terms, QStringList() << "hello" << QString::fromUtf8("w\xc3\xb6rld") << "hel");
+    QCOMPARE(prefixes, QList<bool>() << false << false << true);
+}
+
+void SearchIndexTest::searchPending()
+{
+    QTemporaryDir dir;
+    SearchIndex index(dir.path());
+    QVERIFY(index.open());
+    QVERIFY(index.add(makeEvent("conv-a", 1, "hello there")));
+    QVERIFY(index.add(makeEvent("conv-a", 2, "general kenobi")));
+    QVERIFY(index.add(makeEvent("conv-b", 3, "hello again")));
+    QVERIFY(!index.add(makeEvent("conv-b", 3, "hello again")));
+
+    // newest first
+    QList<SearchHit> hits = index.search("hello", QString(), 10);
+    QCOMPARE(hits.size(), 2);
+    QCOMPARE(hits.at(0).eventId, QString("event-3"));
+    QCOMPARE(hits.at(1).eventId, QString("event-1"));
+
+    QCOMPARE(index.search("hello", "conv-a", 10).size(), 1);
+    QCOMPARE(index.search("hello there", QString(), 10).size(), 1);
+    QCOMPARE(index.search("gen*", QString(), 10).size(), 1);
+    QCOMPARE(index.search("gen", QString(), 10).size(), 0);
+    QCOMPARE(index.search("hello", QString(), 1).size(), 1);
+
+    // the pending log is replayed on open
+    SearchIndex reopened(dir.path());
+    QVERIFY(reopened.open());
+    QCOMPARE(reopened.search("hello", QString(), 10).size(), 2);
+}
+
+void SearchIndexTest::mergeKeepsResults()
+{
+    QTemporaryDir dir;
+    {
+        SearchIndex index(dir.path());
+        QVERIFY(index.open());
+        for (int i = 0; i < SEARCH_MERGE_EVENTS; i++) {
+            QVERIFY(index.add(makeEvent(i % 2 ? "conv-a" : "conv-b", i, QString("word%1 common").arg(i % 100))));
+        }
+        // the merge runs in the background and empties the pending log
+        QTRY_VERIFY_WITH_TIMEOUT(index.indexBytes() == 0, 30000);
+        QCOMPARE(index.search("common", QString(), SEARCH_MERGE_EVENTS * 2).size(), SEARCH_MERGE_EVENTS);
+        QCOMPARE(index.search("word7", QString(), 100).size(), SEARCH_MERGE_EVENTS / 100);
+        QCOMPARE(index.search("word1*", QString(), 100).size(), 11 * SEARCH_MERGE_EVENTS / 100);
+        QCOMPARE(index.search("common", "conv-a", SEARCH_MERGE_EVENTS).size(), SEARCH_MERGE_EVENTS / 2);
+
+        // on disk and pending results come back together
+        QVERIFY(!index.add(makeEvent("conv-a", 1, "word1 common")));
+        QVERIFY(index.add(makeEvent("conv-a", SEARCH_MERGE_EVENTS, "word7 fresh")));
+        QList<SearchHit> hits = index.search("word7", QString(), 100);
+        QCOMPARE(hits.size(), SEARCH_MERGE_EVENTS / 100 + 1);
+        QCOMPARE(hits.first().eventId, QString("event-%1").arg(SEARCH_MERGE_EVENTS));
+        QCOMPARE(hits.at(1).eventId, QString("event-%1").arg(SEARCH_MERGE_EVENTS - 93));
+    }
+
+    SearchIndex index(dir.path());
+    QVERIFY(index.open());
+    QCOMPARE(index.search("common", QString(), SEARCH_MERGE_EVENTS * 2).size(), SEARCH_MERGE_EVENTS);
+    QCOMPARE(index.search("fresh", QString(), 10).size(), 1);
+}
+
+void SearchIndexTest::backfillFromEventStore()
+{
+    QTemporaryDir dir;
+    QString storePath = dir.path() + "/events";
+    {
+        EventStore store(storePath);
+        QVERIFY(store.open());
+        for (int i = 0; i < 10; i++) {
+            QVERIFY(store.append(makeEvent("conv-a", i, QString("stored message %1").arg(i))));
+        }
+    }
+
+    SearchIndex index(dir.path() + "/search");
+    QVERIFY(index.open(storePath));
+    QTRY_COMPARE_WITH_TIMEOUT(index.search("stored", QString(), 100).size(), 10, 30000);
+    QVERIFY(!index.add(makeEvent("conv-a", 3, "stored message 3")));
+    QVERIFY(QFile::exists(dir.path() + "/search/index.dat"));
+}
+
+QTEST_GUILESS_MAIN(SearchIndexTest)
+
+#include "tst_searchindex.moc"
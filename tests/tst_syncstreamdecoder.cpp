@@ -0,0 +1,74 @@
+/**
+ * libhangish
+ * Copyright (C) 2015 Tiago Salem Herrmann
+ * Copyright (C) 2015 Daniele Rogora
+ *
+ * This file is part of libhangish.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QtTest>
+
+#include "syncstreamdecoder.h"
+
+static const char response[] =
+    "[\"csanerp\",[\"hdr\",[1,2]],\"1450000000000000\","
+    "[[\"state-1\",[[\"a\"],{\"k\":\"v\"}]],[\"state-2\",\"brackets ] [ and \\\"quotes\\\"\"]],"
+    "false]";
+
+class SyncStreamDecoderTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void splitsStates();
+    void splitsAcrossChunks();
+    void noStates();
+};
+
+void SyncStreamDecoderTest::splitsStates()
+{
+    SyncStreamDecoder decoder;
+    QList<QByteArray> states = decoder.feed(QByteArray(response));
+    QCOMPARE(states.size(), 2);
+    QCOMPARE(states.at(0), QByteArray("[\"state-1\",[[\"a\"],{\"k\":\"v\"}]]"));
+    QCOMPARE(states.at(1), QByteArray("[\"state-2\",\"brackets ] [ and \\\"quotes\\\"\"]"));
+    QCOMPARE(decoder.skeleton(), QByteArray("[\"csanerp\",[\"hdr\",[1,2]],\"1450000000000000\",[],false]"));
+}
+
+void SyncStreamDecoderTest::splitsAcrossChunks()
+{
+    // one byte at a time cuts through every string, escape and bracket
+    SyncStreamDecoder decoder;
+    QList<QByteArray> states;
+    QByteArray data(response);
+    for (int i = 0; i < data.size(); i++) {
+        states += decoder.feed(data.mid(i, 1));
+    }
+    QCOMPARE(states.size(), 2);
+    QCOMPARE(states.at(1), QByteArray("[\"state-2\",\"brackets ] [ and \\\"quotes\\\"\"]"));
+    QCOMPARE(decoder.skeleton(), QByteArray("[\"csanerp\",[\"hdr\",[1,2]],\"1450000000000000\",[],false]"));
+}
+
+void SyncStreamDecoderTest::noStates()
+{
+    SyncStreamDecoder decoder;
+    QVERIFY(decoder.feed(QByteArray("[\"csanerp\",[\"hdr\"],\"1\",[],true]")).isEmpty());
+    QCOMPARE(decoder.skeleton(), QByteArray("[\"csanerp\",[\"hdr\"],\"1\",[],true]"));
+}
+
+QTEST_GUILESS_MAIN(SyncStreamDecoderTest)
+
+#include "tst_syncstreamdecoder.moc"
@@ -0,0 +1,125 @@
+/**
+ * libhangish
+ * Copyright (C) 2015 Tiago Salem Herrmann
+ * Copyright (C) 2015 Daniele Rogora
+ *
+ * This file is part of libhangish.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QRegExp>
+#include <QtTest>
+
+#include "utils.h"
+
+static QByteArray initBlock(const QByteArray &key, const QByteArray &name, const QByteArray &payload)
+{
+    return "AF_initDataCallback({key: '" + key + "', isError: false, hash: '1', data:function(){return [[\""
+            + name + "\"," + payload + "]\n]\n}});\n";
+}
+
+// roughly the shape of a real init page, padded with blocks nobody asks for
+static QByteArray initPage(int filler)
+{
+    QByteArray page = "<html><head><script>var x = 1;</script>\n";
+    page += initBlock("ds:0", "cin:cac", "[\"api key\"]");
+    page += initBlock("ds:1", "cin:acc", "\"too early\"");
+    page += initBlock("ds:2", "cin:acc", "\"date\",\"version\"");
+    for (int i = 0; i < filler; i++) {
+        page += initBlock("ds:" + QByteArray::number(i + 3), "cin:other", "\"" + QByteArray(200, 'x') + "\",[1,2,3]");
+    }
+    page += initBlock("ds:9999", "csrcrp", "[]");
+    page += "</script></html>\n";
+    return page;
+}
+
+static QSet<QByteArray> initNames()
+{
+    QSet<QByteArray> names;
+    names << "cin:cac" << "cin:bcsc" << "cin:acc" << "cgsirp" << "cgserp" << "csrcrp";
+    return names;
+}
+
+class UtilsTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void scanFindsRequestedBlocks();
+    void scanStopsAtTruncatedBlock();
+    void benchmarkScan_data();
+    void benchmarkScan();
+};
+
+void UtilsTest::scanFindsRequestedBlocks()
+{
+    QList<InitDataBlock> blocks = Utils::scanInitDataBlocks(initPage(10), initNames());
+    QCOMPARE(blocks.size(), 4);
+    QCOMPARE(blocks.at(0).key, QByteArray("ds:0"));
+    QCOMPARE(blocks.at(0).name, QByteArray("cin:cac"));
+    QCOMPARE(blocks.at(0).data, QByteArray("[[\"cin:cac\",[\"api key\"]]\n]\n"));
+    QCOMPARE(blocks.at(1).key, QByteArray("ds:1"));
+    QCOMPARE(blocks.at(2).key, QByteArray("ds:2"));
+    QCOMPARE(blocks.at(2).name, QByteArray("cin:acc"));
+    QCOMPARE(blocks.at(3).name, QByteArray("csrcrp"));
+
+    QVariantList list = Utils::jsArrayToVariantList(QString::fromUtf8(blocks.at(2).data)).value(0).toList();
+    QCOMPARE(list.size(), 3);
+    QCOMPARE(list.at(1).toString(), QString("date"));
+}
+
+void UtilsTest::scanStopsAtTruncatedBlock()
+{
+    QByteArray page = initBlock("ds:0", "cin:cac", "[\"api key\"]");
+    page += "AF_initDataCallback({key: 'ds:1', data:function(){return [[\"cgsirp\",[";
+    QList<InitDataBlock> blocks = Utils::scanInitDataBlocks(page, initNames());
+    QCOMPARE(blocks.size(), 1);
+    QCOMPARE(blocks.at(0).name, QByteArray("cin:cac"));
+}
+
+void UtilsTest::benchmarkScan_data()
+{
+    QTest::addColumn<bool>("singlePass");
+    QTest::newRow("single pass") << true;
+    QTest::newRow("regexp per block") << false;
+}
+
+// compares against what onInitChatReply used to do for each block
+void UtilsTest::benchmarkScan()
+{
+    QFETCH(bool, singlePass);
+    QByteArray page = initPage(2000);
+    QSet<QByteArray> names = initNames();
+    int found = 0;
+    QBENCHMARK {
+        found = 0;
+        if (singlePass) {
+            found = Utils::scanInitDataBlocks(page, names).size();
+        } else {
+            QString text = QString::fromUtf8(page);
+            Q_FOREACH (const QByteArray &name, names) {
+                QRegExp rx("(\\[\\[\"" + QRegExp::escape(QString::fromUtf8(name)) + "\".*\\}\\}\\)\\;)");
+                if (rx.indexIn(text) != -1 && !rx.cap(1).split("}});")[0].isEmpty()) {
+                    found++;
+                }
+            }
+        }
+    }
+    QVERIFY(found >= 3);
+}
+
+QTEST_GUILESS_MAIN(UtilsTest)
+
+#include "tst_utils.moc"
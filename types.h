@@ -22,6 +22,11 @@
 #ifndef TYPES_H
 #define TYPES_H
 
+#include <QSet>
+#include <QSharedPointer>
+#include <QStringList>
+#include <QVector>
+
 #include "hangouts.pb.h"
 
 #define USER_AGENT "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/34.0.1847.132 Safari/537.36"
@@ -32,6 +37,7 @@
 #define CHAT_INIT_URL "https://talkgadget.google.com/u/0/talkgadget/_/chat"
 #define ENDPOINT_URL "https://clients6.google.com/chat/v1/"
 #define ORIGIN_URL "https://talkgadget.google.com"
+#define IMAGE_UPLOAD_URL "https://docs.google.com/upload/photos/resumable?authuser=0"
 
 #define OPERATION_NOOP "noop"
 #define OPERATION_C "c"
@@ -44,6 +50,93 @@
 
 #define MAX_READ_BYTES 1024 * 1024
 
+//Default deadline for requests sent to the chat API:
+#define REQUEST_TIMEOUT_MSECS 30000
+//Deadline for syncallnewevents, whose replies can be large:
+#define SYNC_REQUEST_TIMEOUT_MSECS 60000
+//Number of latency samples kept per endpoint:
+#define LATENCY_SAMPLES 100
+//Minimum number of samples before an idempotent read is hedged:
+#define HEDGE_MIN_SAMPLES 20
+//Window during which presence queries are merged into a single request:
+#define PRESENCE_BATCH_WINDOW_MSECS 50
+//Age after which a presence entry is queried again:
+#define PRESENCE_TTL_SECS 300
+//Window during which unknown entities are collected into one lookup:
+#define ENTITY_BATCH_WINDOW_MSECS 50
+//Maximum number of entities looked up by a single request:
+#define ENTITY_BATCH_SIZE 100
+//Time before an id the server could not resolve is looked up again:
+#define ENTITY_NEGATIVE_TTL_SECS 3600
+
+//Interval after which an unchanged typing state is sent again:
+#define TYPING_REFRESH_SECS 5
+//Interval after which an unchanged focus state is sent again:
+#define FOCUS_REFRESH_SECS 15
+//Timeout to send for setfocus requests:
+#define FOCUS_TIMEOUT_SECS 20
+//Window during which watermark updates are collapsed per conversation:
+#define WATERMARK_WINDOW_MSECS 1000
+
+//Size of each chunk sent by the resumable image upload:
+#define IMAGE_UPLOAD_CHUNK_SIZE (256 * 1024)
+//Maximum number of images uploaded at the same time:
+#define IMAGE_UPLOAD_MAX_PARALLEL 2
+//Number of times an interrupted upload is resumed before giving up:
+#define IMAGE_UPLOAD_MAX_RETRIES 5
+
+//Size of each memory mapped segment of the local event store:
+#define EVENT_STORE_SEGMENT_SIZE (16 * 1024 * 1024)
+
+//Interval between periodic snapshots of users and conversations:
+#define SNAPSHOT_INTERVAL_SECS 300
+#define SNAPSHOT_VERSION 1
+
+//Lifetime of the cached chat init configuration:
+#define INIT_CACHE_TTL_SECS (24 * 3600)
+
+//Number of most recent events kept in memory for each conversation:
+#define CONVERSATION_MAX_EVENTS 50
+//Default memory budget for resident conversation states, 0 means unlimited:
+#define CONVERSATION_CACHE_BUDGET (32 * 1024 * 1024)
+
+//Size limit of each page of syncallnewevents:
+#define SYNC_PAGE_SIZE_BYTES 1048576
+//Upper bound on the pages fetched by a single sync:
+#define SYNC_MAX_PAGES 20
+//Most recently active conversations whose local state is sent with a sync:
+#define SYNC_LOCAL_STATES 50
+//Recent event ids sent for each of them:
+#define SYNC_RECENT_EVENT_IDS 5
+//Conversations caught up at the same time when a sync only returns ids:
+#define SYNC_CATCHUP_PARALLEL 4
+//Attempts at catching up a conversation before falling back to a full sync:
+#define SYNC_CATCHUP_ATTEMPTS 3
+
+//Conversations listed per syncrecentconversations page when looking for gaps:
+#define GAP_SCAN_PAGE_SIZE 50
+//Wait for the events behind a conversation delta before calling it a gap:
+#define GAP_CHECK_DELAY_MSECS 3000
+
+//Bits in each of the two generations of the event dedup Bloom filter:
+#define DEDUP_BLOOM_BITS (1 << 20)
+//Events added to a generation before the older one is dropped:
+#define DEDUP_BLOOM_CAPACITY 100000
+#define DEDUP_BLOOM_HASHES 4
+//Recently delivered event ids remembered exactly:
+#define DEDUP_RECENT_EVENTS 4096
+
+//Number of events requested for each page of history:
+#define HISTORY_PAGE_SIZE 20
+//Default number of history pages kept ahead of the scroll position:
+#define HISTORY_PREFETCH_PAGES 3
+//Default maximum number of hits returned by a local search:
+#define SEARCH_MAX_RESULTS 50
+//Events held in the pending log before they are merged into the on-disk search index:
+#define SEARCH_MERGE_EVENTS 2000
+//Default number of matches returned by autocomplete:
+#define COMPLETION_MAX_RESULTS 10
+
 enum AuthenticationStatus {
     AUTH_WRONG_CREDENTIALS = 0,
     AUTH_NEED_2FACTOR_PIN,
@@ -66,9 +159,144 @@ enum ConnectionStatus {
     CONNECTION_STATUS_CONNECTED
 };
 
+//Interned id, see IdTable:
+typedef quint32 IdHandle;
+
+//Shared, read-only snapshots handed out by HangishClient:
+typedef QSharedPointer<const ClientEntity> ClientEntityPtr;
+typedef QSharedPointer<const ClientConversationState> ConversationStatePtr;
+
+//Startup steps, in the order they are started once their dependencies are done:
+enum BootstrapPhase {
+    BOOTSTRAP_AUTHENTICATION = 0,
+    BOOTSTRAP_PVT_TOKEN,
+    BOOTSTRAP_INIT_PAGE,
+    BOOTSTRAP_SYNC,
+    BOOTSTRAP_CHANNEL_SID,
+    BOOTSTRAP_CHANNEL_POLL,
+    BOOTSTRAP_INIT_DECODE,
+    BOOTSTRAP_PHASE_COUNT
+};
+
+struct BootstrapPhaseState {
+    BootstrapPhaseState() : startedAt(-1), finishedAt(-1), skipped(false) {}
+    //Milliseconds since hangishConnect(), -1 while not reached:
+    qint64 startedAt;
+    qint64 finishedAt;
+    bool skipped;
+};
+
+struct InitDataBlock {
+    QByteArray key;
+    QByteArray name;
+    QByteArray data;
+};
+
 struct OutgoingImage {
+    OutgoingImage() : requestId(0), offset(0), size(0), retries(0), temporary(false) {}
+    quint64 requestId;
     QString filename;
     QString conversationId;
+    QString uploadUrl;
+    qint64 offset;
+    qint64 size;
+    int retries;
+    bool temporary;
+};
+
+struct ImagePreprocessingOptions {
+    ImagePreprocessingOptions() : enabled(false), maxDimension(2048), quality(85), minFileSize(512 * 1024) {}
+    bool enabled;
+    //Longest side, in pixels, of the image that gets uploaded:
+    int maxDimension;
+    //JPEG quality used when re-encoding:
+    int quality;
+    //Files smaller than this are uploaded untouched:
+    qint64 minFileSize;
+};
+
+struct ConversationActivity {
+    ConversationActivity() : typingStatus(-1), typingSentAt(0), focusStatus(-1), focusSentAt(0), watermark(0) {}
+    int typingStatus;
+    qint64 typingSentAt;
+    int focusStatus;
+    qint64 focusSentAt;
+    quint64 watermark;
+};
+
+struct ActivityCounters {
+    ActivityCounters() : suppressedTyping(0), suppressedFocus(0), suppressedWatermarks(0) {}
+    quint64 suppressedTyping;
+    quint64 suppressedFocus;
+    quint64 suppressedWatermarks;
+};
+
+struct DedupCounters {
+    DedupCounters() : unique(0), duplicates(0), bloomChecks(0), bloomFalsePositives(0) {}
+    quint64 unique;
+    quint64 duplicates;
+    //Bloom filter hits that had to be checked against the event store:
+    quint64 bloomChecks;
+    quint64 bloomFalsePositives;
+};
+
+struct PresenceEntry {
+    PresenceEntry() : updatedAt(0), known(false) {}
+    ClientParticipantId userId;
+    ClientPresence presence;
+    qint64 updatedAt;
+    //False when the server had no presence for this id when last asked:
+    bool known;
+};
+
+struct UnreadState {
+    UnreadState() : readTimestamp(0), untracked(0) {}
+    quint64 readTimestamp;
+    //Unread events the server counted that are older than any we have seen:
+    int untracked;
+    //Sorted timestamps of the unread events we have seen:
+    QVector<quint64> events;
+    int count() const { return untracked + events.size(); }
+};
+
+struct SearchHit {
+    QString conversationId;
+    QString eventId;
+    quint64 timestamp;
+};
+
+struct CompletionMatch {
+    //Chat id of a user or id of a conversation:
+    QString id;
+    bool isConversation;
+    QString name;
+};
+
+struct EntityWaiter {
+    quint64 requestId;
+    QSet<IdHandle> pending;
+};
+
+struct PresenceWaiter {
+    quint64 requestId;
+    QSet<IdHandle> ids;
+};
+
+struct HistoryCursor {
+    HistoryCursor() : position(0), inFlight(false), exhausted(false) {}
+    ClientEventContinuationToken token;
+    //Oldest event timestamp of each prefetched page:
+    QList<quint64> pages;
+    //Oldest timestamp the application is showing, 0 before it scrolls:
+    quint64 position;
+    bool inFlight;
+    bool exhausted;
+};
+
+struct HedgedRequest {
+    QString function;
+    QString json;
+    QByteArray member;
 };
 
 #endif // TYPES_H
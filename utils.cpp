@@ -25,7 +25,6 @@
 #include "utils.h"
 
 #include <QDebug>
-#include <QScriptEngine>
 
 void Utils::hangishProtocolDebug(const Message &message) {
     if (!qEnvironmentVariableIsSet("HANGISH_DEBUG")) {
@@ -37,10 +36,67 @@ void Utils::hangishProtocolDebug(const Message &message) {
 QVariantList Utils::jsArrayToVariantList(const QString &jsArray)
 {
     QScriptEngine engine;
+    return jsArrayToVariantList(engine, jsArray);
+}
+
+QVariantList Utils::jsArrayToVariantList(QScriptEngine &engine, const QString &jsArray)
+{
     QScriptValue tree = engine.evaluate(jsArray);
     return tree.toVariant().toList();
 }
 
+// Walks the page once, remembering the key of the current
+// AF_initDataCallback and cutting every [["name", ... }}); block whose
+// name was requested. The block data excludes the trailing }});
+QList<InitDataBlock> Utils::scanInitDataBlocks(const QByteArray &page, const QSet<QByteArray> &names)
+{
+    static const QByteArray keyMarker("key: '");
+    static const QByteArray blockStart("[[\"");
+    static const QByteArray blockEnd("}});");
+
+    QList<InitDataBlock> blocks;
+    QByteArray currentKey;
+    const char *data = page.constData();
+    int size = page.size();
+    int i = 0;
+    while (i < size) {
+        char c = data[i];
+        if (c == 'k' && qstrncmp(data + i, keyMarker.constData(), keyMarker.size()) == 0) {
+            int keyStart = i + keyMarker.size();
+            int keyEnd = page.indexOf('\'', keyStart);
+            if (keyEnd == -1) {
+                break;
+            }
+            currentKey = page.mid(keyStart, keyEnd - keyStart);
+            i = keyEnd + 1;
+        } else if (c == '[' && qstrncmp(data + i, blockStart.constData(), blockStart.size()) == 0) {
+            int nameStart = i + blockStart.size();
+            int nameEnd = page.indexOf('"', nameStart);
+            if (nameEnd == -1) {
+                break;
+            }
+            QByteArray name = page.mid(nameStart, nameEnd - nameStart);
+            if (!names.contains(name)) {
+                i = nameStart;
+                continue;
+            }
+            int end = page.indexOf(blockEnd, nameEnd);
+            if (end == -1) {
+                break;
+            }
+            InitDataBlock block;
+            block.key = currentKey;
+            block.name = name;
+            block.data = page.mid(i, end - i);
+            blocks.append(block);
+            i = end + blockEnd.size();
+        } else {
+            i++;
+        }
+    }
+    return blocks;
+}
+
 void Utils::setMessage(const Reflection& ref,
                        Message& msg,
                        const FieldDescriptor* field,
@@ -27,8 +27,10 @@
 
 #include <google/protobuf/descriptor.pb.h>
 #include <google/protobuf/message.h>
+#include <QSet>
 #include <QString>
 #include <QVariantList>
+#include <QScriptEngine>
 #include "types.h"
 
 using namespace google::protobuf;
@@ -40,6 +42,8 @@ class Utils
 
 public:
     static QVariantList jsArrayToVariantList(const QString &jsArray);
+    static QVariantList jsArrayToVariantList(QScriptEngine &engine, const QString &jsArray);
+    static QList<InitDataBlock> scanInitDataBlocks(const QByteArray &page, const QSet<QByteArray> &names);
     static bool packToMessage(const QVariantList& fields, Message& msg);
     static QString msgToJsArray(Message &msg);
     static void hangishProtocolDebug(const Message &message);